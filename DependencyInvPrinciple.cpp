@@ -17,6 +17,8 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <string_view>
+#include <memory_resource>
 using namespace std;
 
 /***
@@ -34,9 +36,23 @@ enum class Relationship
   sibling
 };
 
+/*
+ A Person's name uses the allocator of whatever holds it. Stored in
+ Relationships, it comes from the same memory resource as the relations,
+ so an arena handed to Relationships owns the names too.
+*/
 struct Person
 {
-  string name;
+  using allocator_type = pmr::polymorphic_allocator<char>;
+
+  pmr::string name;
+
+  Person(string_view name, allocator_type alloc = {}) : name{name, alloc} {}
+  Person(const Person& other, allocator_type alloc = {}) : name{other.name, alloc} {}
+  Person(Person&&) = default;
+  Person(Person&& other, allocator_type alloc) : name{move(other.name), alloc} {}
+  Person& operator=(const Person&) = default;
+  Person& operator=(Person&&) = default;
 };
 
 /* 
@@ -57,12 +73,17 @@ which requires the low-level components to be dependent on high level abstractio
 */
 struct Relationships : RelationshipBrowser
 {
-  vector<tuple<Person, Relationship, Person>> relations;
+  pmr::vector<tuple<Person, Relationship, Person>> relations;
+
+  explicit Relationships(pmr::memory_resource* resource = pmr::get_default_resource())
+    : relations{resource}
+  {
+  }
 
   void add_parent_and_child(const Person& parent, const Person& child)
   {
-    relations.push_back({parent, Relationship::parent, child});
-    relations.push_back({child, Relationship::child, parent});
+    relations.emplace_back(parent, Relationship::parent, child);
+    relations.emplace_back(child, Relationship::child, parent);
   }
 
   vector<Person> find_all_children_of(const string &name) override
@@ -70,7 +91,7 @@ struct Relationships : RelationshipBrowser
     vector<Person> result;
     for (auto&& [first, rel, second] : relations)
     {
-      if (first.name == name && rel == Relationship::parent)
+      if (first.name == string_view{name} && rel == Relationship::parent)
       { 
         result.push_back(second);
       }
@@ -124,7 +145,10 @@ int main()
   Person child1{"Chris"};
   Person child2{"Matt"};
 
-  Relationships relationships;
+  char buffer[1024];
+  pmr::monotonic_buffer_resource arena{buffer, sizeof buffer};
+
+  Relationships relationships{&arena};
   relationships.add_parent_and_child(parent, child1);
   relationships.add_parent_and_child(parent, child2);
 
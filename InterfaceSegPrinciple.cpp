@@ -8,6 +8,29 @@
 */
 
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <unordered_map>
+#include <numeric>
+#include <deque>
+#include <map>
+#include <fstream>
+#include <cstdio>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 struct Document;
 
 // This is a "polluted" or "fat" interface
@@ -74,4 +97,1054 @@ struct Machine : IMachine
 };
 
 // IPrinter --> Printer
-// everything --> Machine
\ No newline at end of file
+// everything --> Machine
+
+/*
+ Rasterizing is one more capability a device may or may not need, so it
+ gets its own small interface instead of another method on IPrinter.
+*/
+
+// 8-bit grayscale raster, 255 is white paper
+struct Page
+{
+  int width, height;
+  std::vector<uint8_t> pixels;
+
+  Page(int width, int height)
+    : width{width}, height{height},
+      pixels(static_cast<size_t>(width) * height, 255) { }
+};
+
+struct IPageRenderer
+{
+  virtual Page render(const std::string& text) = 0;
+};
+
+/*
+ Built-in 3x5 bitmap font covering digits and letters; one glyph per
+ 15-bit row-major mask, top-left pixel in bit 14.
+*/
+namespace builtin_font
+{
+  const int glyph_width = 3, glyph_height = 5;
+
+  const uint16_t glyphs[] = {
+    0x7b6f, 0x2c97, 0x73e7, 0x73cf, 0x5bc9, 0x79cf, 0x79ef, 0x7249, 0x7bef, 0x7bcf,
+    0x2bed, 0x6bae, 0x3923, 0x6b6e, 0x79a7, 0x79a4, 0x396b, 0x5bed, 0x7497, 0x126a,
+    0x5bad, 0x4927, 0x5fed, 0x6b6d, 0x2b6a, 0x6ba4, 0x2b73, 0x6bad, 0x388e, 0x7492,
+    0x5b6f, 0x5b6a, 0x5bfd, 0x5aad, 0x5a92, 0x72a7,
+  };
+
+  inline uint16_t mask(char32_t c)
+  {
+    if (c >= '0' && c <= '9') return glyphs[c - '0'];
+    if (c >= 'A' && c <= 'Z') return glyphs[10 + c - 'A'];
+    if (c >= 'a' && c <= 'z') return glyphs[10 + c - 'a'];
+    return 0;
+  }
+}
+
+/*
+ Scaled glyph coverage bitmaps, built on first use and shared by every
+ thread that renders. Lookups take a shared lock, so concurrent renderers
+ only serialize when a glyph is missing; the bitmap itself is built
+ outside the lock. Entries are never evicted, so references handed out
+ stay valid (unordered_map does not move its nodes on rehash).
+*/
+class GlyphCache
+{
+  std::shared_mutex mutex;
+  std::unordered_map<uint64_t, std::vector<uint8_t>> glyphs;
+
+public:
+  const std::vector<uint8_t>& get(int scale, char32_t c)
+  {
+    uint64_t key = uint64_t(scale) << 32 | c;
+    {
+      std::shared_lock<std::shared_mutex> lock{mutex};
+      auto it = glyphs.find(key);
+      if (it != glyphs.end())
+        return it->second;
+    }
+
+    int w = builtin_font::glyph_width * scale;
+    int h = builtin_font::glyph_height * scale;
+    std::vector<uint8_t> coverage(static_cast<size_t>(w) * h, 0);
+    uint16_t bits = builtin_font::mask(c);
+    for (int y = 0; y < h; ++y)
+      for (int x = 0; x < w; ++x)
+      {
+        int bit = 14 - ((y / scale) * builtin_font::glyph_width + x / scale);
+        coverage[y * w + x] = (bits >> bit & 1) ? 255 : 0;
+      }
+
+    // another thread may have added it meanwhile; emplace keeps the first
+    std::unique_lock<std::shared_mutex> lock{mutex};
+    return glyphs.emplace(key, std::move(coverage)).first->second;
+  }
+};
+
+class TextRenderer : public IPageRenderer
+{
+  int page_width, page_height, scale, margin;
+  GlyphCache& cache;
+
+  // the page and the cached coverage never overlap, and whole blocks of 16
+  // need no epilogue, so the block loop vectorizes even at -O2
+  static void darken_row(uint8_t* __restrict dst, const uint8_t* __restrict src, int n)
+  {
+    int x = 0;
+    for (; x + 16 <= n; x += 16)
+      for (int i = 0; i < 16; ++i)
+        dst[x + i] = static_cast<uint8_t>(dst[x + i] * (255 - src[x + i]) / 255);
+    for (; x < n; ++x)
+      dst[x] = static_cast<uint8_t>(dst[x] * (255 - src[x]) / 255);
+  }
+
+  // darkens the page by the glyph coverage, one row at a time
+  void blit(Page& page, const std::vector<uint8_t>& coverage, int px, int py)
+  {
+    int w = builtin_font::glyph_width * scale;
+    int h = builtin_font::glyph_height * scale;
+    for (int y = 0; y < h && py + y < page.height; ++y)
+      darken_row(&page.pixels[static_cast<size_t>(py + y) * page.width + px],
+                 &coverage[static_cast<size_t>(y) * w],
+                 std::min(w, page.width - px));
+  }
+
+public:
+  TextRenderer(GlyphCache& cache, int page_width, int page_height,
+               int scale = 2, int margin = 8)
+    : page_width{page_width}, page_height{page_height},
+      scale{scale}, margin{margin}, cache{cache} { }
+
+  Page render(const std::string& text) override
+  {
+    Page page{page_width, page_height};
+    int advance = (builtin_font::glyph_width + 1) * scale;
+    int line_height = (builtin_font::glyph_height + 2) * scale;
+    int x = margin, y = margin;
+    for (char c : text)
+    {
+      if (c == '\n' || x + advance > page_width - margin)
+      {
+        x = margin;
+        y += line_height;
+        if (c == '\n')
+          continue;
+      }
+      if (y + line_height > page_height - margin)
+        break;
+      blit(page, cache.get(scale, static_cast<unsigned char>(c)), x, y);
+      x += advance;
+    }
+    return page;
+  }
+};
+
+// Renders pages on at most one thread per core; each thread takes the next
+// unrendered page, and the glyph cache is shared between them. The first
+// exception thrown by a renderer is passed on to the caller.
+inline std::vector<Page> render_pages(IPageRenderer& renderer,
+                                      const std::vector<std::string>& texts)
+{
+  std::vector<Page> pages(texts.size(), Page{0, 0});
+  std::atomic<size_t> next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&] {
+    for (size_t i; (i = next++) < texts.size();)
+    {
+      try
+      {
+        pages[i] = renderer.render(texts[i]);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock{error_mutex};
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+
+  size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(cores, texts.size()); ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& t : threads)
+    t.join();
+  if (error)
+    std::rethrow_exception(error);
+  return pages;
+}
+
+/*
+ Halftoning turns a grayscale Page into the 1-bit raster a printer head
+ needs. Each algorithm is an IHalftoner, so a job picks one by passing it.
+*/
+
+// 1-bit raster, rows padded to whole bytes, MSB is the leftmost pixel
+struct Bitmap
+{
+  int width, height, stride;
+  std::vector<uint8_t> bits;
+
+  Bitmap(int width, int height)
+    : width{width}, height{height}, stride{(width + 7) / 8},
+      bits(static_cast<size_t>((width + 7) / 8) * height, 0) { }
+
+  void set(int x, int y) { bits[y * stride + x / 8] |= 0x80 >> (x % 8); }
+  bool get(int x, int y) const { return bits[y * stride + x / 8] & (0x80 >> (x % 8)); }
+};
+
+struct IHalftoner
+{
+  virtual Bitmap halftone(const Page& page) = 0;
+};
+
+/*
+ Ordered dithering compares each pixel with a tiled 4x4 Bayer threshold
+ matrix, with no state between pixels. A page is processed row by row
+ against one of four precomputed threshold rows, and the row kernel is
+ compiled for AVX2 as well as in scalar form; the best one the CPU
+ supports is bound on first use. force_simd_level pins a level instead,
+ so the AVX2 kernel can be compared with the scalar one.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define HALFTONE_KERNEL_DISPATCH 1
+#endif
+
+enum class SimdLevel { scalar, avx2 };
+
+namespace dither_kernels
+{
+  // sets the bit of every pixel darker than its threshold; bits start zeroed
+  using RowKernel = void (*)(const uint8_t*, const uint8_t*, uint8_t*, int);
+
+  inline void row_tail(const uint8_t* row, const uint8_t* thresholds,
+                       uint8_t* bits, int from, int width)
+  {
+    for (int x = from; x < width; ++x)
+      if (row[x] < thresholds[x])
+        bits[x / 8] |= 0x80 >> (x % 8);
+  }
+
+  inline void row_scalar(const uint8_t* row, const uint8_t* thresholds,
+                         uint8_t* bits, int width)
+  {
+    row_tail(row, thresholds, bits, 0, width);
+  }
+
+#ifdef HALFTONE_KERNEL_DISPATCH
+  // 32 pixels per step: max_epu8 finds the pixels at or above their
+  // threshold, a byte shuffle mirrors every group of 8 so the leftmost
+  // pixel lands in the top bit, and movemask yields four output bytes
+  __attribute__((target("avx2")))
+  inline void row_avx2(const uint8_t* row, const uint8_t* thresholds,
+                       uint8_t* bits, int width)
+  {
+    const __m256i mirror = _mm256_setr_epi8(
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+      __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x));
+      __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(thresholds + x));
+      __m256i light = _mm256_cmpeq_epi8(_mm256_max_epu8(p, t), p);
+      uint32_t dark = ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_shuffle_epi8(light, mirror)));
+      std::memcpy(bits + x / 8, &dark, sizeof dark);  // byte k holds pixels 8k..8k+7
+    }
+    row_tail(row, thresholds, bits, x, width);
+  }
+#endif
+
+  inline SimdLevel detect()
+  {
+#ifdef HALFTONE_KERNEL_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+      return SimdLevel::avx2;
+#endif
+    return SimdLevel::scalar;
+  }
+
+  inline RowKernel select(SimdLevel level)
+  {
+#ifdef HALFTONE_KERNEL_DISPATCH
+    if (level == SimdLevel::avx2)
+      return row_avx2;
+#endif
+    return row_scalar;
+  }
+
+  inline RowKernel& row()
+  {
+    static RowKernel kernel = select(detect());
+    return kernel;
+  }
+}
+
+// levels the CPU lacks fall back to the best supported one
+inline void force_simd_level(SimdLevel level)
+{
+  dither_kernels::row() = dither_kernels::select(std::min(level, dither_kernels::detect()));
+}
+
+struct OrderedDither : IHalftoner
+{
+  Bitmap halftone(const Page& page) override
+  {
+    static const uint8_t bayer[4][4] = {
+      {  8, 136,  40, 168},
+      {200,  72, 232, 104},
+      { 56, 184,  24, 152},
+      {248, 120, 216,  88}};
+
+    Bitmap out{page.width, page.height};
+    if (page.width <= 0)
+      return out;
+    std::vector<uint8_t> thresholds(4 * static_cast<size_t>(page.width));
+    for (int y = 0; y < 4; ++y)
+      for (int x = 0; x < page.width; ++x)
+        thresholds[static_cast<size_t>(y) * page.width + x] = bayer[y][x % 4];
+
+    auto kernel = dither_kernels::row();
+    for (int y = 0; y < page.height; ++y)
+      kernel(&page.pixels[static_cast<size_t>(y) * page.width],
+             &thresholds[static_cast<size_t>(y % 4) * page.width],
+             &out.bits[static_cast<size_t>(y) * out.stride], page.width);
+    return out;
+  }
+};
+
+/*
+ Floyd-Steinberg error diffusion, run as a wavefront. A pixel needs the
+ errors of the three pixels above it, so each row can run on its own
+ thread as long as it stays a few pixels behind the row above: rows are
+ claimed in order, work in blocks of pixels, and publish how far they
+ have got. Only the rows in flight hold error buffers (one ring slot per
+ thread, plus one), and the integer sums are the same as in a sequential
+ pass, so the output does not depend on the number of threads.
+*/
+struct ErrorDiffusion : IHalftoner
+{
+  Bitmap halftone(const Page& page) override
+  {
+    Bitmap out{page.width, page.height};
+    if (page.width <= 0 || page.height <= 0)
+      return out;
+
+    const int block = 256;
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                      static_cast<size_t>(page.height));
+    size_t ring = threads + 1;
+    // slot y % ring: errors carried into row y, and how far row y has got
+    // (tagged with the row, as y * span + pixels done, so reuse is visible)
+    std::vector<std::vector<int>> incoming(ring, std::vector<int>(page.width + 2, 0));
+    std::unique_ptr<std::atomic<int64_t>[]> progress{new std::atomic<int64_t>[ring]};
+    for (size_t i = 0; i < ring; ++i)
+      progress[i] = -1;
+    const int64_t span = int64_t{page.width} + 1;
+    auto wait_for = [&](int64_t row, int64_t pixels) {
+      if (row < 0)
+        return;
+      auto& slot = progress[static_cast<size_t>(row) % ring];
+      while (slot.load(std::memory_order_acquire) < row * span + pixels)
+        std::this_thread::yield();
+    };
+
+    std::atomic<int> next_row{0};
+    auto worker = [&] {
+      for (int y; (y = next_row++) < page.height;)
+      {
+        // the slot written below must be cleared by its previous row first
+        wait_for(int64_t{y} + 1 - static_cast<int64_t>(ring), page.width);
+        std::vector<int>& current = incoming[y % ring];
+        std::vector<int>& next = incoming[(y + 1) % ring];
+        auto& done = progress[y % ring];
+        const uint8_t* row = &page.pixels[static_cast<size_t>(y) * page.width];
+
+        for (int x0 = 0; x0 < page.width; x0 += block)
+        {
+          int x1 = std::min(x0 + block, page.width);
+          wait_for(y - 1, std::min(x1 + 2, page.width));
+          for (int x = x0; x < x1; ++x)
+          {
+            int value = row[x] + current[x + 1] / 16;
+            int error = value;
+            if (value < 128)
+              out.bits[static_cast<size_t>(y) * out.stride + x / 8] |= 0x80 >> (x % 8);
+            else
+              error = value - 255;
+            current[x + 2] += error * 7;
+            next[x] += error * 3;
+            next[x + 1] += error * 5;
+            next[x + 2] += error;
+          }
+          if (x1 < page.width)
+            done.store(y * span + x1, std::memory_order_release);
+        }
+        std::fill(current.begin(), current.end(), 0);
+        done.store(y * span + page.width, std::memory_order_release);
+      }
+    };
+
+    std::vector<std::thread> helpers;
+    for (size_t i = 1; i < threads; ++i)
+      helpers.emplace_back(worker);
+    worker();
+    for (auto& t : helpers)
+      t.join();
+    return out;
+  }
+};
+
+/*
+ Imposition places several pages on each side of a sheet (N-up) and
+ orders them for duplex booklets. A Sheet only records where each page
+ goes; pixels are touched once, when the sheet is rasterized for printing.
+*/
+struct Placement
+{
+  const Page* page;
+  int x, y, width, height;
+};
+
+struct Sheet
+{
+  int width, height;
+  std::vector<Placement> placements;
+};
+
+// Page order for a 2-up saddle-stitched booklet printed duplex: sides
+// alternate front/back, and -1 is a blank filler page.
+inline std::vector<int> booklet_order(int page_count)
+{
+  int n = (page_count + 3) / 4 * 4;
+  std::vector<int> order;
+  for (int i = 0; i < n / 2; i += 2)
+    order.insert(order.end(), {n - 1 - i, i, i + 1, n - 2 - i});
+  for (auto& index : order)
+    if (index >= page_count)
+      index = -1;
+  return order;
+}
+
+inline std::vector<Sheet> impose(const std::vector<Page>& pages,
+                                 const std::vector<int>& order,
+                                 int cols, int rows,
+                                 int sheet_width, int sheet_height)
+{
+  if (cols <= 0 || rows <= 0 || sheet_width < cols || sheet_height < rows)
+    throw std::invalid_argument("sheet too small for the requested grid");
+  int cell_width = sheet_width / cols, cell_height = sheet_height / rows;
+  std::vector<Sheet> sheets;
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    size_t slot = i % (cols * rows);
+    if (slot == 0)
+      sheets.push_back({sheet_width, sheet_height, {}});
+    if (order[i] < 0)
+      continue;
+
+    // fit the page into its cell keeping the aspect ratio, centered;
+    // empty pages and pages that scale to nothing are left blank
+    const Page& page = pages.at(order[i]);
+    if (page.width <= 0 || page.height <= 0)
+      continue;
+    int w = cell_width, h = cell_height;
+    if (int64_t{page.width} * cell_height > int64_t{page.height} * cell_width)
+      h = static_cast<int>(int64_t{page.height} * cell_width / page.width);
+    else
+      w = static_cast<int>(int64_t{page.width} * cell_height / page.height);
+    if (w == 0 || h == 0)
+      continue;
+    int x = static_cast<int>(slot % cols) * cell_width + (cell_width - w) / 2;
+    int y = static_cast<int>(slot / cols) * cell_height + (cell_height - h) / 2;
+    sheets.back().placements.push_back({&page, x, y, w, h});
+  }
+  return sheets;
+}
+
+inline std::vector<Sheet> impose(const std::vector<Page>& pages,
+                                 int cols, int rows,
+                                 int sheet_width, int sheet_height)
+{
+  std::vector<int> order(pages.size());
+  std::iota(order.begin(), order.end(), 0);
+  return impose(pages, order, cols, rows, sheet_width, sheet_height);
+}
+
+// Nearest-neighbour resampling; the source column of every output column
+// is computed once per placement so the inner loop is a plain gather.
+inline Page rasterize(const Sheet& sheet)
+{
+  Page out{sheet.width, sheet.height};
+  std::vector<int> columns;
+  for (auto& p : sheet.placements)
+  {
+    columns.resize(p.width);
+    for (int x = 0; x < p.width; ++x)
+      columns[x] = static_cast<int>(int64_t{x} * p.page->width / p.width);
+
+    for (int y = 0; y < p.height; ++y)
+    {
+      int sy = static_cast<int>(int64_t{y} * p.page->height / p.height);
+      const uint8_t* src = &p.page->pixels[static_cast<size_t>(sy) * p.page->width];
+      uint8_t* dst = &out.pixels[static_cast<size_t>(p.y + y) * out.width + p.x];
+      for (int x = 0; x < p.width; ++x)
+        dst[x] = src[columns[x]];
+    }
+  }
+  return out;
+}
+
+/*
+ Imposition as a stage of the page pipeline. An ImposingPrinter looks like
+ any other page printer: it collects the pages of a job and, on flush,
+ imposes them and passes the rasterized sheets on to the next printer.
+ Pages are taken by value, so a caller that moves a page in hands over its
+ pixel buffer instead of having it copied. Booklet order is 2-up, so a
+ booklet needs a grid of exactly two cells.
+*/
+struct IPagePrinter
+{
+  virtual void print(Page page) = 0;
+};
+
+struct ImposingPrinter : IPagePrinter
+{
+  IPagePrinter& next;
+  int cols, rows, sheet_width, sheet_height;
+  bool booklet;
+  std::vector<Page> pages;
+
+  ImposingPrinter(IPagePrinter& next, int cols, int rows,
+                  int sheet_width, int sheet_height, bool booklet = false)
+    : next{next}, cols{cols}, rows{rows},
+      sheet_width{sheet_width}, sheet_height{sheet_height}, booklet{booklet}
+  {
+    if (booklet && int64_t{cols} * rows != 2)
+      throw std::invalid_argument("booklet imposition needs a 2-up grid");
+  }
+
+  void print(Page page) override { pages.push_back(std::move(page)); }
+
+  void flush()
+  {
+    auto sheets = booklet
+      ? impose(pages, booklet_order(static_cast<int>(pages.size())),
+               cols, rows, sheet_width, sheet_height)
+      : impose(pages, cols, rows, sheet_width, sheet_height);
+    for (auto& sheet : sheets)
+      next.print(rasterize(sheet));
+    pages.clear();
+  }
+};
+
+/*
+ Holds pages queued for a device. Up to budget bytes of pixels stay in
+ memory; pages beyond that are appended to spool segment files and read
+ back in queue order. Whenever a page leaves, spilled pages at the head of
+ the queue are prefetched back into the memory that was freed.
+
+ A new segment file is started once the current one reaches
+ segment_bytes, and a segment is deleted as soon as none of its pages are
+ still on disk, so the spool never holds much more than the spilled pages.
+ Any failure to create, write or read a segment throws.
+*/
+class PageSpool
+{
+  struct Entry
+  {
+    int width, height;
+    size_t segment;
+    std::streamoff offset;
+    std::vector<uint8_t> pixels;
+    bool spilled;
+  };
+
+  size_t budget, segment_bytes, in_memory = 0;
+  std::string path;
+  std::deque<Entry> queue;
+
+  std::map<size_t, size_t> spilled_pages;  // segment -> pages still on disk
+  size_t next_segment = 0, write_segment = 0, read_segment = 0;
+  std::ofstream writer;
+  std::ifstream reader;
+  std::streamoff write_offset = 0;
+
+  std::string segment_path(size_t segment) const
+  {
+    return path + "." + std::to_string(segment);
+  }
+
+  void drop_segment(size_t segment)
+  {
+    if (reader.is_open() && read_segment == segment)
+      reader.close();
+    spilled_pages.erase(segment);
+    std::remove(segment_path(segment).c_str());
+  }
+
+  void start_segment()
+  {
+    if (writer.is_open())
+    {
+      writer.close();
+      if (spilled_pages[write_segment] == 0)
+        drop_segment(write_segment);
+    }
+    write_segment = next_segment++;
+    spilled_pages[write_segment] = 0;
+    writer.open(segment_path(write_segment), std::ios::binary | std::ios::trunc);
+    if (!writer)
+      throw std::runtime_error("cannot create spool file " + segment_path(write_segment));
+    write_offset = 0;
+  }
+
+  void spill(Entry& e)
+  {
+    if (!writer.is_open() || write_offset >= static_cast<std::streamoff>(segment_bytes))
+      start_segment();
+    writer.write(reinterpret_cast<const char*>(e.pixels.data()), e.pixels.size());
+    writer.flush();
+    if (!writer)
+      throw std::runtime_error("cannot write spool file " + segment_path(write_segment));
+
+    e.segment = write_segment;
+    e.offset = write_offset;
+    e.spilled = true;
+    write_offset += e.pixels.size();
+    ++spilled_pages[write_segment];
+    e.pixels.clear();
+    e.pixels.shrink_to_fit();
+  }
+
+  void load(Entry& e)
+  {
+    if (!reader.is_open() || read_segment != e.segment)
+    {
+      reader.close();
+      reader.open(segment_path(e.segment), std::ios::binary);
+      read_segment = e.segment;
+    }
+    e.pixels.resize(static_cast<size_t>(e.width) * e.height);
+    reader.seekg(e.offset);
+    reader.read(reinterpret_cast<char*>(e.pixels.data()), e.pixels.size());
+    if (!reader)
+      throw std::runtime_error("cannot read spool file " + segment_path(e.segment));
+
+    e.spilled = false;
+    in_memory += e.pixels.size();
+    if (--spilled_pages[e.segment] == 0 && e.segment != write_segment)
+      drop_segment(e.segment);
+  }
+
+  void prefetch()
+  {
+    for (auto& e : queue)
+    {
+      if (!e.spilled)
+        continue;
+      if (in_memory + static_cast<size_t>(e.width) * e.height > budget)
+        break;
+      load(e);
+    }
+  }
+
+public:
+  PageSpool(size_t budget, std::string path, size_t segment_bytes = 64 << 20)
+    : budget{budget}, segment_bytes{segment_bytes}, path{std::move(path)} { }
+
+  PageSpool(const PageSpool&) = delete;
+  PageSpool& operator=(const PageSpool&) = delete;
+
+  ~PageSpool()
+  {
+    writer.close();
+    reader.close();
+    while (!spilled_pages.empty())
+      drop_segment(spilled_pages.begin()->first);
+  }
+
+  bool empty() const { return queue.empty(); }
+
+  void push(Page page)
+  {
+    Entry e{page.width, page.height, 0, 0, std::move(page.pixels), false};
+    if (in_memory + e.pixels.size() <= budget)
+      in_memory += e.pixels.size();
+    else
+      spill(e);
+    queue.push_back(std::move(e));
+  }
+
+  Page pop()
+  {
+    if (queue.front().spilled)
+      load(queue.front());
+    Entry e = std::move(queue.front());
+    queue.pop_front();
+    in_memory -= e.pixels.size();
+
+    Page page{0, 0};
+    page.width = e.width;
+    page.height = e.height;
+    page.pixels = std::move(e.pixels);
+
+    prefetch();
+    return page;
+  }
+};
+
+/*
+ Routes calls over a pool of interchangeable devices. Each device keeps
+ an EWMA of its latency and of its error rate, fed by every call whether
+ it succeeds or fails. Devices whose error rate is below max_error_rate
+ are tried first, fastest first, and the rest only after them, so a
+ device that keeps failing drops behind the working ones after a single
+ failure. A demoted device may never be called again while others work,
+ so its error rate also decays with time (halving every error_half_life)
+ and it returns to the front once it drops below the limit; a device that
+ is still broken then fails its probe call and is demoted again. A circuit breaker takes a device out of rotation for the cooldown
+ after failure_threshold failures in a row. A failing call falls over to
+ the next device, and the last error is rethrown only if every device
+ failed. The health table is guarded by a mutex, but the calls themselves
+ run outside it, so concurrent jobs can use different devices at once.
+*/
+class DeviceRouter
+{
+  using clock = std::chrono::steady_clock;
+
+  struct Health
+  {
+    double latency_ewma = 0;
+    double error_ewma = 0;
+    int consecutive_failures = 0;
+    clock::time_point open_until{};
+    clock::time_point error_updated{};
+  };
+
+  std::mutex mutex;
+  std::vector<Health> health;
+  int failure_threshold;
+  clock::duration cooldown;
+  double max_error_rate;
+  clock::duration error_half_life;
+  double alpha = 0.2;
+
+  double error_rate(const Health& h, clock::time_point now) const
+  {
+    auto idle = std::chrono::duration<double>(now - h.error_updated);
+    return h.error_ewma * std::exp2(-idle / error_half_life);
+  }
+
+  void record(size_t i, clock::time_point start, bool failed)
+  {
+    auto now = clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    std::lock_guard<std::mutex> lock{mutex};
+    Health& h = health[i];
+    h.latency_ewma = alpha * seconds + (1 - alpha) * h.latency_ewma;
+    h.error_ewma = alpha * (failed ? 1.0 : 0.0) + (1 - alpha) * error_rate(h, now);
+    h.error_updated = now;
+    if (!failed)
+      h.consecutive_failures = 0;
+    else if (++h.consecutive_failures >= failure_threshold)
+      h.open_until = clock::now() + cooldown;
+  }
+
+public:
+  DeviceRouter(size_t devices, int failure_threshold = 3,
+               clock::duration cooldown = std::chrono::seconds{5},
+               double max_error_rate = 0.1,
+               clock::duration error_half_life = std::chrono::seconds{1})
+    : health(devices), failure_threshold{failure_threshold},
+      cooldown{cooldown}, max_error_rate{max_error_rate},
+      error_half_life{error_half_life} { }
+
+  template <typename Call> void run(Call call)
+  {
+    std::vector<size_t> order;
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      auto now = clock::now();
+      for (size_t i = 0; i < health.size(); ++i)
+        if (health[i].open_until <= now)
+          order.push_back(i);
+      auto rank = [&](size_t i) {
+        return std::make_pair(error_rate(health[i], now) >= max_error_rate,
+                              health[i].latency_ewma);
+      };
+      std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return rank(a) < rank(b); });
+    }
+
+    std::exception_ptr error;
+    for (size_t i : order)
+    {
+      auto start = clock::now();
+      try
+      {
+        call(i);
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+        record(i, start, true);
+        continue;
+      }
+      record(i, start, false);
+      return;
+    }
+    if (!error)
+      error = std::make_exception_ptr(std::runtime_error("no healthy device"));
+    std::rethrow_exception(error);
+  }
+};
+
+// A pool looks like a single device, so Machine can be given one unchanged.
+struct PrinterPool : IPrinter
+{
+  std::vector<IPrinter*> printers;
+  DeviceRouter router;
+
+  explicit PrinterPool(std::vector<IPrinter*> printers)
+    : printers{std::move(printers)}, router{this->printers.size()} { }
+
+  void print(Document& doc) override {
+    router.run([&](size_t i) { printers[i]->print(doc); });
+  }
+};
+
+struct ScannerPool : IScanner
+{
+  std::vector<IScanner*> scanners;
+  DeviceRouter router;
+
+  explicit ScannerPool(std::vector<IScanner*> scanners)
+    : scanners{std::move(scanners)}, router{this->scanners.size()} { }
+
+  void scan(Document& doc) override {
+    router.run([&](size_t i) { scanners[i]->scan(doc); });
+  }
+};
+
+/*
+ Codecs for storing and forwarding scanned pages.
+ PackBits run-length coding suits bilevel rows, which are mostly long
+ runs of 0x00 or 0xff. Grayscale pages are first passed through a
+ left-neighbour delta predictor, which turns flat areas into runs of
+ zeros that PackBits then collapses; both steps are exactly reversible.
+*/
+namespace page_codec
+{
+  inline void packbits_encode(const uint8_t* data, size_t n, std::vector<uint8_t>& out)
+  {
+    auto run_at = [&](size_t i) {
+      return i + 2 < n && data[i] == data[i + 1] && data[i] == data[i + 2];
+    };
+
+    size_t i = 0;
+    while (i < n)
+    {
+      if (run_at(i))
+      {
+        size_t run = 3;
+        while (i + run < n && run < 128 && data[i + run] == data[i])
+          ++run;
+        out.push_back(static_cast<uint8_t>(257 - run));
+        out.push_back(data[i]);
+        i += run;
+        continue;
+      }
+
+      size_t start = i++;
+      while (i < n && i - start < 128 && !run_at(i))
+        ++i;
+      out.push_back(static_cast<uint8_t>(i - start - 1));
+      out.insert(out.end(), data + start, data + i);
+    }
+  }
+
+  inline std::vector<uint8_t> packbits_decode(const std::vector<uint8_t>& in,
+                                              size_t expected_size)
+  {
+    std::vector<uint8_t> out;
+    out.reserve(expected_size);
+    for (size_t i = 0; i < in.size();)
+    {
+      uint8_t header = in[i++];
+      if (header < 128)
+      {
+        size_t count = std::min<size_t>(header + 1, in.size() - i);
+        out.insert(out.end(), in.begin() + i, in.begin() + i + count);
+        i += count;
+      }
+      else if (header > 128 && i < in.size())
+        out.insert(out.end(), 257 - header, in[i++]);
+    }
+    if (out.size() != expected_size)
+      throw std::runtime_error("corrupt PackBits stream");
+    return out;
+  }
+
+  inline std::vector<uint8_t> encode(const Bitmap& bitmap)
+  {
+    std::vector<uint8_t> out;
+    if (bitmap.stride == 0)
+      return out;
+    for (int y = 0; y < bitmap.height; ++y)
+      packbits_encode(&bitmap.bits[static_cast<size_t>(y) * bitmap.stride],
+                      bitmap.stride, out);
+    return out;
+  }
+
+  inline Bitmap decode_bitmap(const std::vector<uint8_t>& in, int width, int height)
+  {
+    Bitmap bitmap{width, height};
+    bitmap.bits = packbits_decode(in, bitmap.bits.size());
+    return bitmap;
+  }
+
+  inline std::vector<uint8_t> encode(const Page& page)
+  {
+    std::vector<uint8_t> residuals(page.pixels.size());
+    for (int y = 0; page.width > 0 && y < page.height; ++y)
+    {
+      const uint8_t* src = &page.pixels[static_cast<size_t>(y) * page.width];
+      uint8_t* dst = &residuals[static_cast<size_t>(y) * page.width];
+      dst[0] = src[0];
+      for (int x = 1; x < page.width; ++x)
+        dst[x] = static_cast<uint8_t>(src[x] - src[x - 1]);
+    }
+    std::vector<uint8_t> out;
+    packbits_encode(residuals.data(), residuals.size(), out);
+    return out;
+  }
+
+  inline Page decode_page(const std::vector<uint8_t>& in, int width, int height)
+  {
+    Page page{width, height};
+    page.pixels = packbits_decode(in, page.pixels.size());
+    for (int y = 0; width > 0 && y < height; ++y)
+    {
+      uint8_t* row = &page.pixels[static_cast<size_t>(y) * width];
+      for (int x = 1; x < width; ++x)
+        row[x] = static_cast<uint8_t>(row[x] + row[x - 1]);
+    }
+    return page;
+  }
+
+  // compresses on another thread so the scanner can move on to the next page
+  inline std::future<std::vector<uint8_t>> encode_async(Page page)
+  {
+    return std::async(std::launch::async,
+      [page = std::move(page)] { return encode(page); });
+  }
+}
+
+/*
+ Simulated devices for exercising the router: a call sleeps for the
+ device's latency and then throws if the device is failing.
+*/
+struct SimulatedDevice
+{
+  bool failing;
+  std::chrono::milliseconds latency;
+  std::atomic<int> calls{0};
+
+  SimulatedDevice(bool failing, std::chrono::milliseconds latency)
+    : failing{failing}, latency{latency} { }
+
+  void operator()()
+  {
+    ++calls;
+    std::this_thread::sleep_for(latency);
+    if (failing)
+      throw std::runtime_error("simulated device failure");
+  }
+};
+
+int main()
+{
+  using std::chrono::milliseconds;
+
+  // a broken device, a slow one and a fast one
+  SimulatedDevice broken{true, milliseconds{0}};
+  SimulatedDevice slow{false, milliseconds{5}};
+  SimulatedDevice fast{false, milliseconds{1}};
+  SimulatedDevice* devices[] = {&broken, &slow, &fast};
+
+  DeviceRouter router{3};
+  std::vector<std::thread> jobs;
+  for (int t = 0; t < 4; ++t)
+    jobs.emplace_back([&] {
+      for (int i = 0; i < 10; ++i)
+        router.run([&](size_t d) { (*devices[d])(); });
+    });
+  for (auto& job : jobs)
+    job.join();
+  std::printf("broken: %d calls, slow: %d calls, fast: %d calls\n",
+              broken.calls.load(), slow.calls.load(), fast.calls.load());
+
+  // a fast device that fails once is demoted, then comes back
+  SimulatedDevice flaky{true, milliseconds{1}};
+  SimulatedDevice backup{false, milliseconds{5}};
+  SimulatedDevice* flaky_pool[] = {&flaky, &backup};
+  DeviceRouter recovering{2, 3, std::chrono::seconds{5}, 0.1, milliseconds{50}};
+  recovering.run([&](size_t d) { (*flaky_pool[d])(); });
+  flaky.failing = false;
+  for (int i = 0; i < 200; ++i)
+    recovering.run([&](size_t d) { (*flaky_pool[d])(); });
+  std::printf("flaky: %d calls, backup: %d calls\n",
+              flaky.calls.load(), backup.calls.load());
+
+  // with every device failing the error reaches the caller
+  DeviceRouter lonely{1};
+  for (int i = 0; i < 4; ++i)
+  {
+    try
+    {
+      lonely.run([&](size_t) { broken(); });
+    }
+    catch (const std::exception& e)
+    {
+      std::printf("call %d failed: %s\n", i, e.what());
+    }
+  }
+
+  // a letter page at 600 dpi, a horizontal gradient with some texture
+  Page sheet{5100, 6600};
+  for (int y = 0; y < sheet.height; ++y)
+    for (int x = 0; x < sheet.width; ++x)
+      sheet.pixels[static_cast<size_t>(y) * sheet.width + x] =
+        static_cast<uint8_t>(x * 255 / sheet.width ^ (y & 15));
+
+  // the AVX2 dither kernel must agree with the scalar one bit for bit
+  OrderedDither ordered;
+  force_simd_level(SimdLevel::scalar);
+  auto expected = ordered.halftone(sheet).bits;
+  force_simd_level(SimdLevel::avx2);
+  if (ordered.halftone(sheet).bits != expected)
+    std::printf("AVX2 ordered dither disagrees with scalar\n");
+
+  ErrorDiffusion diffusion;
+  std::pair<const char*, IHalftoner*> halftoners[] = {
+    {"ordered dither", &ordered}, {"error diffusion", &diffusion}};
+  for (auto& [name, halftoner] : halftoners)
+  {
+    const int pages = 5;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < pages; ++i)
+      halftoner->halftone(sheet);
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    std::printf("%s: %.1f pages/sec at 600 dpi\n", name, pages / seconds);
+  }
+  return 0;
+}
\ No newline at end of file
@@ -19,27 +19,57 @@ Rules of this principle
 */
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <numeric>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <future>
+#include <thread>
+#include <functional>
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 class Rectangle
 {
 protected:
   int width, height;
 public:
-  Rectangle(const int width, const int height)
+  constexpr Rectangle(const int width, const int height)
     : width{width}, height{height} { }
 
-  int get_width() const { return width; }
+  constexpr int get_width() const { return width; }
   virtual void set_width(const int width) { this->width = width; }
-  int get_height() const { return height; }
+  constexpr int get_height() const { return height; }
   virtual void set_height(const int height) { this->height = height; }
 
-  int area() const { return width * height; }
+  constexpr int area() const { return width * height; }
+
+  // area() wraps around for large sides; these variants do not
+  constexpr int64_t area64() const { return int64_t{width} * height; }
+  int saturating_area() const
+  {
+    return static_cast<int>(std::clamp<int64_t>(area64(), INT_MIN, INT_MAX));
+  }
+  // returns false and leaves out untouched if the area does not fit an int
+  bool checked_area(int& out) const
+  {
+    int64_t a = area64();
+    if (a < INT_MIN || a > INT_MAX)
+      return false;
+    out = static_cast<int>(a);
+    return true;
+  }
 };
 
 class Square : public Rectangle
 {
 public:
-  Square(int size): Rectangle(size,size) {}
+  constexpr Square(int size): Rectangle(size,size) {}
   void set_width(const int width) override {
     this->width = height = width;
   }
@@ -63,6 +93,744 @@ void process(Rectangle& r)
     << ", got " << r.area() << std::endl;
 }
 
+/*
+ A non-virtual rectangle for layouts that are fixed at build time.
+ Every operation is constexpr, so whole layouts can be evaluated by the
+ compiler. A square here is only a rectangle with equal sides, made by
+ fixed_square - there is no subtype that could break substitution.
+*/
+struct FixedRectangle
+{
+  int width, height;
+
+  constexpr void set_width(const int w) { width = w; }
+  constexpr void set_height(const int h) { height = h; }
+  constexpr int64_t area() const { return int64_t{width} * height; }
+  constexpr bool fits_in(const FixedRectangle& bin) const
+  {
+    return width <= bin.width && height <= bin.height;
+  }
+};
+
+constexpr FixedRectangle fixed_square(const int size) { return {size, size}; }
+
+template <size_t N>
+constexpr int64_t total_area(const FixedRectangle (&layout)[N])
+{
+  int64_t total = 0;
+  for (auto& r : layout)
+    total += r.area();
+  return total;
+}
+
+template <size_t N>
+constexpr bool all_fit(const FixedRectangle (&layout)[N],
+                       const FixedRectangle& bin)
+{
+  for (auto& r : layout)
+    if (!r.fits_in(bin))
+      return false;
+  return true;
+}
+
+constexpr FixedRectangle sheet{100, 50};
+constexpr FixedRectangle sheet_layout[] = {
+  {40, 20}, {60, 30}, fixed_square(25)};
+static_assert(all_fit(sheet_layout, sheet), "layout does not fit the sheet");
+static_assert(total_area(sheet_layout) == 3225, "unexpected layout area");
+
+/*
+ Total area covered by many positioned rectangles, overlaps counted once.
+
+ A sweep line moves along x. Between two events the covered length on the
+ y axis is constant, and it is kept in a segment tree over the compressed
+ y coordinates, so each event costs O(log n).
+
+ Large inputs are cut into vertical strips with about the same number of
+ edges each, and the strips are swept in parallel; a rectangle crossing a
+ strip boundary is clipped into every strip it touches. Edges are 64-bit,
+ and since int rectangles can cover more than 2^63 units in total, the
+ products and the sum are checked and std::overflow_error is thrown
+ rather than returning a wrapped value.
+*/
+struct PlacedRectangle
+{
+  int x, y;
+  Rectangle rect;
+};
+
+class CoverageTree
+{
+  std::vector<int64_t> ys;
+  std::vector<int> count;
+  std::vector<int64_t> covered;
+
+  void update(size_t node, size_t lo, size_t hi, int64_t y0, int64_t y1, int delta)
+  {
+    if (y1 <= ys[lo] || ys[hi] <= y0)
+      return;
+    if (y0 <= ys[lo] && ys[hi] <= y1)
+      count[node] += delta;
+    else
+    {
+      size_t mid = (lo + hi) / 2;
+      update(2 * node, lo, mid, y0, y1, delta);
+      update(2 * node + 1, mid, hi, y0, y1, delta);
+    }
+
+    if (count[node] > 0)
+      covered[node] = ys[hi] - ys[lo];
+    else if (hi - lo == 1)
+      covered[node] = 0;
+    else
+      covered[node] = covered[2 * node] + covered[2 * node + 1];
+  }
+
+public:
+  explicit CoverageTree(std::vector<int64_t> coords) : ys{std::move(coords)}
+  {
+    std::sort(ys.begin(), ys.end());
+    ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+    count.assign(4 * ys.size() + 1, 0);
+    covered.assign(4 * ys.size() + 1, 0);
+  }
+
+  void add(int64_t y0, int64_t y1, int delta)
+  {
+    if (ys.size() > 1)
+      update(1, 0, ys.size() - 1, y0, y1, delta);
+  }
+
+  int64_t length() const { return covered[1]; }
+};
+
+namespace sweep
+{
+  // edges are computed in 64 bits: x + width can exceed the int range
+  struct Edges { int64_t x0, x1, y0, y1; };
+
+  inline int64_t checked_add(int64_t total, int64_t length, int64_t dx)
+  {
+    if (length != 0 && dx > (INT64_MAX - total) / length)
+      throw std::overflow_error("union area does not fit in int64_t");
+    return total + length * dx;
+  }
+
+  // area of the union of rects clipped to the strip [lo, hi) along x
+  inline int64_t strip_area(const std::vector<Edges>& rects, int64_t lo, int64_t hi)
+  {
+    struct Event { int64_t x, y0, y1; int delta; };
+    std::vector<Event> events;
+    std::vector<int64_t> ys;
+    for (auto& r : rects)
+    {
+      int64_t x0 = std::max(r.x0, lo), x1 = std::min(r.x1, hi);
+      if (x0 >= x1)
+        continue;
+      events.push_back({x0, r.y0, r.y1, +1});
+      events.push_back({x1, r.y0, r.y1, -1});
+      ys.push_back(r.y0);
+      ys.push_back(r.y1);
+    }
+    std::sort(events.begin(), events.end(),
+      [](const Event& a, const Event& b) { return a.x < b.x; });
+
+    CoverageTree tree{std::move(ys)};
+    int64_t total = 0;
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+      if (i > 0)
+        total = checked_add(total, tree.length(), events[i].x - events[i - 1].x);
+      tree.add(events[i].y0, events[i].y1, events[i].delta);
+    }
+    return total;
+  }
+}
+
+int64_t union_area(const std::vector<PlacedRectangle>& rects)
+{
+  std::vector<sweep::Edges> edges;
+  std::vector<int64_t> xs;
+  for (auto& r : rects)
+  {
+    int w = r.rect.get_width(), h = r.rect.get_height();
+    if (w <= 0 || h <= 0)
+      continue;
+    int64_t x0 = r.x, y0 = r.y;
+    edges.push_back({x0, x0 + w, y0, y0 + h});
+    xs.push_back(x0);
+    xs.push_back(x0 + w);
+  }
+
+  const size_t min_edges_per_strip = 1 << 14;
+  size_t strips = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                   xs.size() / min_edges_per_strip);
+  if (strips <= 1)
+    return sweep::strip_area(edges, INT64_MIN, INT64_MAX);
+
+  // strip boundaries at quantiles of the edge positions
+  std::sort(xs.begin(), xs.end());
+  std::vector<int64_t> bounds{INT64_MIN};
+  for (size_t i = 1; i < strips; ++i)
+    if (xs[i * xs.size() / strips] > bounds.back())
+      bounds.push_back(xs[i * xs.size() / strips]);
+  bounds.push_back(INT64_MAX);
+
+  std::vector<std::future<int64_t>> parts;
+  for (size_t i = 0; i + 1 < bounds.size(); ++i)
+    parts.push_back(std::async(std::launch::async, sweep::strip_area,
+                               std::cref(edges), bounds[i], bounds[i + 1]));
+  int64_t total = 0;
+  for (auto& part : parts)
+    total = sweep::checked_add(total, part.get(), 1);
+  return total;
+}
+
+/*
+ Shapes stored column-wise so that batch algorithms can walk plain arrays
+ of widths and heights instead of chasing Rectangle objects.
+*/
+struct ShapeBatch
+{
+  enum class Kind : uint8_t { rectangle, square };
+
+  std::vector<Kind> kinds;
+  std::vector<int> widths;
+  std::vector<int> heights;
+
+  void add(const Rectangle& r)
+  {
+    kinds.push_back(dynamic_cast<const Square*>(&r) ? Kind::square
+                                                    : Kind::rectangle);
+    widths.push_back(r.get_width());
+    heights.push_back(r.get_height());
+  }
+
+  size_t size() const { return widths.size(); }
+};
+
+/*
+ Batch versions of area64 and checked_area over the ShapeBatch columns.
+ The loops are branch-free: overflow is collected into a flag for the
+ whole batch instead of being tested per shape.
+*/
+std::vector<int64_t> areas64(const ShapeBatch& batch)
+{
+  std::vector<int64_t> out(batch.size());
+  for (size_t i = 0; i < batch.size(); ++i)
+    out[i] = int64_t{batch.widths[i]} * batch.heights[i];
+  return out;
+}
+
+/*
+ The checked kernel has a scalar, an SSE4.2 and an AVX2 version, and the
+ best level the CPU supports is bound on first use. force_simd_level pins
+ a level instead, so each variant can be compared with the scalar one.
+ Compilers without x86 target attributes only get the scalar kernel.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define SHAPE_KERNEL_DISPATCH 1
+#endif
+
+enum class SimdLevel { scalar, sse42, avx2 };
+
+namespace area_kernels
+{
+  // returns a nonzero value if any area did not fit in an int
+  using CheckedKernel = int64_t (*)(const int*, const int*, int*, size_t);
+
+  inline int64_t checked_body(const int* widths, const int* heights,
+                              int* out, size_t n)
+  {
+    int64_t overflow = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      int64_t a = int64_t{widths[i]} * heights[i];
+      int narrowed = static_cast<int>(a);
+      overflow |= a ^ narrowed;
+      out[i] = narrowed;
+    }
+    return overflow;
+  }
+
+  int64_t checked_scalar(const int* w, const int* h, int* out, size_t n)
+  {
+    return checked_body(w, h, out, n);
+  }
+
+#ifdef SHAPE_KERNEL_DISPATCH
+  /*
+   The vector kernels multiply 32-bit lanes twice: mullo gives the narrowed
+   areas, and mul_epi32 on the even and the shifted odd lanes gives the full
+   64-bit products, whose high halves are gathered into one register. An
+   area fits when its high half equals the sign of its low half. Leftover
+   shapes at the end go through the scalar loop.
+  */
+  __attribute__((target("sse4.2")))
+  int64_t checked_sse42(const int* w, const int* h, int* out, size_t n)
+  {
+    __m128i overflow = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i));
+      __m128i lo = _mm_mullo_epi32(a, b);
+      __m128i even = _mm_mul_epi32(a, b);
+      __m128i odd = _mm_mul_epi32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+      __m128i hi = _mm_blend_epi16(_mm_srli_epi64(even, 32), odd, 0xCC);
+      overflow = _mm_or_si128(overflow, _mm_xor_si128(hi, _mm_srai_epi32(lo, 31)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lo);
+    }
+    return checked_body(w + i, h + i, out + i, n - i)
+           | !_mm_testz_si128(overflow, overflow);
+  }
+
+  __attribute__((target("avx2")))
+  int64_t checked_avx2(const int* w, const int* h, int* out, size_t n)
+  {
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i));
+      __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h + i));
+      __m256i lo = _mm256_mullo_epi32(a, b);
+      __m256i even = _mm256_mul_epi32(a, b);
+      __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+      __m256i hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+      overflow = _mm256_or_si256(overflow, _mm256_xor_si256(hi, _mm256_srai_epi32(lo, 31)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), lo);
+    }
+    return checked_body(w + i, h + i, out + i, n - i)
+           | !_mm256_testz_si256(overflow, overflow);
+  }
+#endif
+
+  inline SimdLevel detect()
+  {
+#ifdef SHAPE_KERNEL_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+      return SimdLevel::avx2;
+    if (__builtin_cpu_supports("sse4.2"))
+      return SimdLevel::sse42;
+#endif
+    return SimdLevel::scalar;
+  }
+
+  inline CheckedKernel select(SimdLevel level)
+  {
+#ifdef SHAPE_KERNEL_DISPATCH
+    if (level == SimdLevel::avx2)
+      return checked_avx2;
+    if (level == SimdLevel::sse42)
+      return checked_sse42;
+#endif
+    return checked_scalar;
+  }
+
+  inline CheckedKernel& checked()
+  {
+    static CheckedKernel kernel = select(detect());
+    return kernel;
+  }
+}
+
+// levels the CPU lacks fall back to the best supported one
+inline void force_simd_level(SimdLevel level)
+{
+  area_kernels::checked() = area_kernels::select(std::min(level, area_kernels::detect()));
+}
+
+// false if any area in the batch does not fit in an int
+bool checked_areas(const ShapeBatch& batch, std::vector<int>& out)
+{
+  out.resize(batch.size());
+  return area_kernels::checked()(batch.widths.data(), batch.heights.data(),
+                                 out.data(), batch.size()) == 0;
+}
+
+/*
+ On-disk form of a ShapeBatch: a 16-byte header (magic, format version,
+ byte-order marker, shape count) followed by the kind, width and height
+ columns as raw native-endian arrays. The header is checked against the
+ real file size before anything is allocated.
+
+ A Reader streams the file in chunks, so batch kernels can run over files
+ larger than memory; load is simply one chunk holding everything.
+*/
+namespace shape_file
+{
+  const char magic[4] = {'S', 'H', 'P', 'B'};
+  const uint16_t version = 1;
+  const uint16_t byte_order = 0x0102;  // reads back as 0x0201 on the other endianness
+  const std::streamoff header_size = 16;
+  const std::streamoff bytes_per_shape = sizeof(ShapeBatch::Kind) + 2 * sizeof(int32_t);
+  static_assert(sizeof(int) == sizeof(int32_t), "columns are stored as int32");
+
+  void save(const ShapeBatch& batch, const std::string& filename)
+  {
+    std::ofstream ofs(filename, std::ios::binary);
+    uint64_t count = batch.size();
+    ofs.write(magic, sizeof magic);
+    ofs.write(reinterpret_cast<const char*>(&version), sizeof version);
+    ofs.write(reinterpret_cast<const char*>(&byte_order), sizeof byte_order);
+    ofs.write(reinterpret_cast<const char*>(&count), sizeof count);
+    ofs.write(reinterpret_cast<const char*>(batch.kinds.data()),
+              count * sizeof(ShapeBatch::Kind));
+    ofs.write(reinterpret_cast<const char*>(batch.widths.data()),
+              count * sizeof(int));
+    ofs.write(reinterpret_cast<const char*>(batch.heights.data()),
+              count * sizeof(int));
+    if (!ofs)
+      throw std::runtime_error("cannot write shape batch file: " + filename);
+  }
+
+  class Reader
+  {
+    std::string filename;
+    std::ifstream ifs;
+    uint64_t count = 0, next = 0;
+
+    template <typename T>
+    void read_column(std::vector<T>& column, std::streamoff offset, size_t n)
+    {
+      column.resize(n);
+      ifs.seekg(offset + static_cast<std::streamoff>(next * sizeof(T)));
+      ifs.read(reinterpret_cast<char*>(column.data()), n * sizeof(T));
+      if (!ifs)
+        throw std::runtime_error("cannot read shape batch file: " + filename);
+    }
+
+  public:
+    explicit Reader(const std::string& filename)
+      : filename{filename}, ifs{filename, std::ios::binary | std::ios::ate}
+    {
+      if (!ifs)
+        throw std::runtime_error("cannot open shape batch file: " + filename);
+      std::streamoff file_size = ifs.tellg();
+      ifs.seekg(0);
+
+      char header[sizeof magic];
+      uint16_t file_version = 0, file_byte_order = 0;
+      ifs.read(header, sizeof header);
+      ifs.read(reinterpret_cast<char*>(&file_version), sizeof file_version);
+      ifs.read(reinterpret_cast<char*>(&file_byte_order), sizeof file_byte_order);
+      ifs.read(reinterpret_cast<char*>(&count), sizeof count);
+      if (!ifs || !std::equal(header, header + sizeof header, magic))
+        throw std::runtime_error("not a shape batch file: " + filename);
+      if (file_version != version)
+        throw std::runtime_error("unsupported shape batch version: " + filename);
+      if (file_byte_order != byte_order)
+        throw std::runtime_error("shape batch file has foreign byte order: " + filename);
+      if (count > static_cast<uint64_t>(file_size - header_size) / bytes_per_shape
+          || header_size + static_cast<std::streamoff>(count) * bytes_per_shape != file_size)
+        throw std::runtime_error("shape count does not match file size: " + filename);
+    }
+
+    uint64_t size() const { return count; }
+
+    // replaces batch with up to max_shapes next shapes; false once all are read
+    bool read_chunk(ShapeBatch& batch, size_t max_shapes)
+    {
+      if (next == count || max_shapes == 0)
+        return false;
+      size_t n = static_cast<size_t>(std::min<uint64_t>(max_shapes, count - next));
+
+      std::streamoff kinds_at = header_size;
+      std::streamoff widths_at = kinds_at + static_cast<std::streamoff>(count * sizeof(ShapeBatch::Kind));
+      std::streamoff heights_at = widths_at + static_cast<std::streamoff>(count * sizeof(int));
+      read_column(batch.kinds, kinds_at, n);
+      read_column(batch.widths, widths_at, n);
+      read_column(batch.heights, heights_at, n);
+      for (auto kind : batch.kinds)
+        if (kind != ShapeBatch::Kind::rectangle && kind != ShapeBatch::Kind::square)
+          throw std::runtime_error("invalid shape kind in: " + filename);
+      next += n;
+      return true;
+    }
+  };
+
+  ShapeBatch load(const std::string& filename)
+  {
+    Reader reader{filename};
+    ShapeBatch batch;
+    reader.read_chunk(batch, static_cast<size_t>(reader.size()));
+    return batch;
+  }
+}
+
+/*
+ Packs rectangles into a fixed bin with the skyline bottom-left heuristic.
+ The skyline is the upper outline of everything placed so far; a new
+ rectangle goes where it would rest lowest, ties broken to the left.
+ Rectangles can be inserted one at a time or as a whole ShapeBatch.
+*/
+class SkylinePacker
+{
+  struct Segment { int x, y, width; };
+
+  int bin_width, bin_height;
+  std::vector<Segment> skyline;
+
+  bool fits(size_t i, int w, int h, int& y) const
+  {
+    int x = skyline[i].x;
+    if (x + w > bin_width)
+      return false;
+    y = 0;
+    for (int remaining = w; remaining > 0; remaining -= skyline[i++].width)
+    {
+      y = std::max(y, skyline[i].y);
+      if (y + h > bin_height)
+        return false;
+    }
+    return true;
+  }
+
+  // The new segment replaces the ones it fully covers and trims the one it
+  // partly covers, then merges with equal-height neighbours: one insert or
+  // erase per placement, not one per covered segment.
+  void place(size_t i, int w, int h, int y)
+  {
+    int x = skyline[i].x, right = x + w;
+    size_t j = i;
+    while (j < skyline.size() && skyline[j].x + skyline[j].width <= right)
+      ++j;
+    if (j < skyline.size() && skyline[j].x < right)
+    {
+      skyline[j].width -= right - skyline[j].x;
+      skyline[j].x = right;
+    }
+
+    if (j == i)
+      skyline.insert(skyline.begin() + i, {x, y + h, w});
+    else
+    {
+      skyline[i] = {x, y + h, w};
+      skyline.erase(skyline.begin() + i + 1, skyline.begin() + j);
+    }
+
+    if (i + 1 < skyline.size() && skyline[i + 1].y == skyline[i].y)
+    {
+      skyline[i].width += skyline[i + 1].width;
+      skyline.erase(skyline.begin() + i + 1);
+    }
+    if (i > 0 && skyline[i - 1].y == skyline[i].y)
+    {
+      skyline[i - 1].width += skyline[i].width;
+      skyline.erase(skyline.begin() + i);
+    }
+  }
+
+public:
+  struct Position { int x, y; bool placed; };
+
+  SkylinePacker(int bin_width, int bin_height)
+    : bin_width{bin_width}, bin_height{bin_height},
+      skyline{{0, 0, bin_width}} { }
+
+  Position insert(int w, int h)
+  {
+    if (w <= 0 || h <= 0)
+      return {0, 0, false};
+
+    size_t best = skyline.size();
+    int best_y = INT_MAX;
+    for (size_t i = 0; i < skyline.size(); ++i)
+    {
+      int y;
+      if (fits(i, w, h, y) && y < best_y)
+      {
+        best = i;
+        best_y = y;
+      }
+    }
+    if (best == skyline.size())
+      return {0, 0, false};
+
+    int x = skyline[best].x;
+    place(best, w, h, best_y);
+    return {x, best_y, true};
+  }
+
+  // Tallest shapes first packs noticeably tighter; results keep batch order.
+  std::vector<Position> insert(const ShapeBatch& batch)
+  {
+    std::vector<size_t> order(batch.size());
+    std::iota(order.begin(), order.end(), size_t{0});
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return batch.heights[a] > batch.heights[b];
+    });
+
+    std::vector<Position> result(batch.size());
+    for (size_t i : order)
+      result[i] = insert(batch.widths[i], batch.heights[i]);
+    return result;
+  }
+};
+
+/*
+ Packs rectangles into a fixed bin with the MaxRects best-short-side-fit
+ heuristic. It keeps every maximal free rectangle, so it finds gaps the
+ skyline cannot reach, at the cost of more bookkeeping per placement.
+ Free rectangles created by a split are only compared with the others,
+ since the surviving old ones cannot contain each other.
+*/
+class MaxRectsPacker
+{
+  struct Rect { int x, y, w, h; };
+
+  int bin_width, bin_height;
+  std::vector<Rect> free_rects;
+
+  static bool intersects(const Rect& a, const Rect& b)
+  {
+    return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+  }
+
+  static bool contains(const Rect& outer, const Rect& inner)
+  {
+    return inner.x >= outer.x && inner.y >= outer.y
+      && inner.x + inner.w <= outer.x + outer.w
+      && inner.y + inner.h <= outer.y + outer.h;
+  }
+
+  void place(const Rect& used)
+  {
+    std::vector<Rect> created;
+    for (size_t i = 0; i < free_rects.size();)
+    {
+      Rect f = free_rects[i];
+      if (!intersects(f, used))
+      {
+        ++i;
+        continue;
+      }
+      free_rects[i] = free_rects.back();
+      free_rects.pop_back();
+      if (used.x > f.x)
+        created.push_back({f.x, f.y, used.x - f.x, f.h});
+      if (used.x + used.w < f.x + f.w)
+        created.push_back({used.x + used.w, f.y, f.x + f.w - used.x - used.w, f.h});
+      if (used.y > f.y)
+        created.push_back({f.x, f.y, f.w, used.y - f.y});
+      if (used.y + used.h < f.y + f.h)
+        created.push_back({f.x, used.y + used.h, f.w, f.y + f.h - used.y - used.h});
+    }
+
+    size_t old_count = free_rects.size();
+    for (size_t i = 0; i < created.size(); ++i)
+    {
+      bool redundant = false;
+      for (size_t j = 0; j < old_count && !redundant; ++j)
+        redundant = contains(free_rects[j], created[i]);
+      // of two equal rectangles only the first is kept
+      for (size_t j = 0; j < created.size() && !redundant; ++j)
+        redundant = j != i && contains(created[j], created[i])
+          && (j < i || !contains(created[i], created[j]));
+      if (!redundant)
+        free_rects.push_back(created[i]);
+    }
+  }
+
+public:
+  struct Position { int x, y; bool placed; };
+
+  MaxRectsPacker(int bin_width, int bin_height)
+    : bin_width{bin_width}, bin_height{bin_height},
+      free_rects{{0, 0, bin_width, bin_height}} { }
+
+  Position insert(int w, int h)
+  {
+    const Rect* best = nullptr;
+    int best_short = INT_MAX, best_long = INT_MAX;
+    for (auto& f : free_rects)
+    {
+      if (w > f.w || h > f.h)
+        continue;
+      int short_side = std::min(f.w - w, f.h - h);
+      int long_side = std::max(f.w - w, f.h - h);
+      if (short_side < best_short || (short_side == best_short && long_side < best_long))
+      {
+        best = &f;
+        best_short = short_side;
+        best_long = long_side;
+      }
+    }
+    if (!best)
+      return {0, 0, false};
+
+    Rect used{best->x, best->y, w, h};
+    place(used);
+    return {used.x, used.y, true};
+  }
+};
+
+/*
+ Packs a whole batch into as many bins as it takes. Shapes go tallest
+ first into the current bin, and a new bin is opened when one does not
+ fit, so the cost per shape stays bounded by the state of a single bin.
+ Shapes larger than a bin get bin -1.
+*/
+enum class PackingHeuristic { skyline, max_rects };
+
+struct Packing
+{
+  struct Placement { int bin, x, y; };
+
+  PackingHeuristic heuristic;
+  std::vector<Placement> placements;
+  int bins = 0;
+};
+
+template <typename Packer>
+Packing pack_into_bins(const ShapeBatch& batch, int bin_width, int bin_height,
+                       PackingHeuristic heuristic)
+{
+  std::vector<size_t> order(batch.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return batch.heights[a] > batch.heights[b];
+  });
+
+  Packing result{heuristic, std::vector<Packing::Placement>(batch.size()), 0};
+  Packer packer{bin_width, bin_height};
+  for (size_t i : order)
+  {
+    int w = batch.widths[i], h = batch.heights[i];
+    if (w <= 0 || h <= 0 || w > bin_width || h > bin_height)
+    {
+      result.placements[i] = {-1, 0, 0};
+      continue;
+    }
+    if (result.bins == 0)
+      result.bins = 1;
+    auto pos = packer.insert(w, h);
+    if (!pos.placed)
+    {
+      packer = Packer{bin_width, bin_height};
+      pos = packer.insert(w, h);
+      ++result.bins;
+    }
+    result.placements[i] = {result.bins - 1, pos.x, pos.y};
+  }
+  return result;
+}
+
+// Runs both heuristics concurrently and keeps the one needing fewer bins.
+inline Packing pack(const ShapeBatch& batch, int bin_width, int bin_height)
+{
+  auto skyline = std::async(std::launch::async, [&] {
+    return pack_into_bins<SkylinePacker>(batch, bin_width, bin_height,
+                                         PackingHeuristic::skyline);
+  });
+  Packing max_rects = pack_into_bins<MaxRectsPacker>(
+    batch, bin_width, bin_height, PackingHeuristic::max_rects);
+  Packing best = skyline.get();
+  return max_rects.bins < best.bins ? max_rects : best;
+}
+
 int main()
 {
   Rectangle r{ 5,5 };
@@ -71,6 +839,66 @@ int main()
   Square s{ 5 };
   process(s);
 
+  std::vector<PlacedRectangle> layout{
+    {0, 0, Rectangle{4, 4}}, {2, 2, Rectangle{4, 4}}, {10, 0, Square{3}}};
+  std::cout << "union area = " << union_area(layout) << std::endl;
+
+  ShapeBatch batch;
+  batch.add(Rectangle{6, 2});
+  batch.add(Square{4});
+  batch.add(Rectangle{3, 5});
+  batch.add(Square{100000});
+  std::vector<int> areas;
+  if (!checked_areas(batch, areas))
+  {
+    auto exact = areas64(batch);
+    std::cout << "some areas overflow int, largest is "
+      << *std::max_element(exact.begin(), exact.end()) << std::endl;
+  }
+
+  // every kernel level must agree with the scalar one, overflow flag included
+  ShapeBatch mixed;
+  for (int i = 1; i <= 1000; ++i)
+    mixed.add(Rectangle{i * 37, i * 41});
+  mixed.widths[3] = -5;
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    force_simd_level(SimdLevel::scalar);
+    std::vector<int> expected, got;
+    bool expected_fit = checked_areas(mixed, expected);
+    for (SimdLevel level : {SimdLevel::sse42, SimdLevel::avx2})
+    {
+      force_simd_level(level);
+      if (checked_areas(mixed, got) != expected_fit || got != expected)
+        std::cout << "SIMD level " << static_cast<int>(level)
+          << " disagrees with scalar" << std::endl;
+    }
+    mixed.heights[501] = -(1 << 20);  // second pass: one area overflows
+  }
+  force_simd_level(SimdLevel::avx2);
+
+  shape_file::save(batch, "shapes.bin");
+  std::cout << "reloaded " << shape_file::load("shapes.bin").size()
+    << " shapes" << std::endl;
+
+  shape_file::Reader reader{"shapes.bin"};
+  ShapeBatch chunk;
+  int64_t streamed_area = 0;
+  while (reader.read_chunk(chunk, 2))
+    for (int64_t a : areas64(chunk))
+      streamed_area += a;
+  std::cout << "streamed total area = " << streamed_area << std::endl;
+
+  SkylinePacker packer{10, 10};
+  for (auto& pos : packer.insert(batch))
+    std::cout << "packed at (" << pos.x << ", " << pos.y << ")"
+      << (pos.placed ? "" : " - does not fit") << std::endl;
+
+  Packing packing = pack(batch, 10, 10);
+  std::cout << "packed into " << packing.bins << " bins with "
+    << (packing.heuristic == PackingHeuristic::skyline ? "skyline" : "MaxRects")
+    << std::endl;
+
   getchar();
   return 0;
 }
\ No newline at end of file
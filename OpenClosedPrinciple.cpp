@@ -49,6 +49,30 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <limits>
+#include <unordered_set>
+#include <unordered_map>
+#include <string_view>
+#include <functional>
+#include <map>
+#include <future>
+#include <cmath>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 enum class Color { red, green, blue };
@@ -170,6 +194,933 @@ template <typename T> struct AndSpecification : Specification<T>
   }
 };
 
+/*Membership in a large set of names*/
+
+/*
+ Checking an allow-list or deny-list of many names. A blocked Bloom
+ filter sits in front of an open-addressing table: each name maps to one
+ 64-bit word with three bits set in it, so most non-members are rejected
+ with a single memory access. Table slots store the full hash next to the
+ name, so a probe compares hashes first and a name is hashed only once
+ per lookup, for the filter and the table alike.
+*/
+template <typename T> struct InSetSpecification : Specification<T>
+{
+  struct Slot
+  {
+    size_t hash;
+    const string* name;  // null for an empty slot
+  };
+
+  vector<string> names;
+  vector<Slot> slots;
+  vector<uint64_t> bloom;
+  size_t mask, slot_mask;
+
+  explicit InSetSpecification(const vector<string>& members)
+    : names(members)
+  {
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+
+    size_t words = 1;
+    while (words * 64 < names.size() * 16)  // about 16 bits per name
+      words *= 2;
+    bloom.assign(words, 0);
+    mask = words - 1;
+
+    size_t size = 2;
+    while (size < names.size() * 2)  // at most half full
+      size *= 2;
+    slots.assign(size, {0, nullptr});
+    slot_mask = size - 1;
+
+    for (auto& name : names)
+    {
+      size_t h = hash<string>{}(name);
+      bloom[h >> 20 & mask] |= bits(h);
+      size_t i = h & slot_mask;
+      while (slots[i].name)
+        i = (i + 1) & slot_mask;
+      slots[i] = {h, &name};
+    }
+  }
+
+  static uint64_t bits(size_t h)
+  {
+    return 1ull << (h & 63) | 1ull << (h >> 6 & 63) | 1ull << (h >> 12 & 63);
+  }
+
+  bool is_satisfied(T* item) const override {
+    size_t h = hash<string>{}(item->name);
+    uint64_t b = bits(h);
+    if ((bloom[h >> 20 & mask] & b) != b)
+      return false;
+    for (size_t i = h & slot_mask; slots[i].name; i = (i + 1) & slot_mask)
+      if (slots[i].hash == h && *slots[i].name == item->name)
+        return true;
+    return false;
+  }
+};
+
+/*Names within a few typos of a given name*/
+
+/*
+ Matches products whose name is within max_distance edits (insertions,
+ deletions, substitutions) of the query. Names whose length alone rules
+ them out are rejected first. The rest go through Myers' bit-parallel
+ edit distance, which handles up to 64 query characters per machine word.
+ Longer queries use the plain dynamic programming recurrence.
+*/
+struct NameFuzzySpecification : Specification<Product>
+{
+  string query;
+  size_t max_distance;
+  uint64_t peq[256] = {};
+
+  NameFuzzySpecification(string query, size_t max_distance)
+    : query{move(query)}, max_distance{max_distance}
+  {
+    for (size_t i = 0; i < this->query.size() && i < 64; ++i)
+      peq[static_cast<unsigned char>(this->query[i])] |= 1ull << i;
+  }
+
+  size_t distance(const string& text) const
+  {
+    size_t m = query.size();
+    if (m == 0)
+      return text.size();
+    if (m > 64)
+      return dp_distance(text);
+
+    uint64_t pv = ~0ull, mv = 0, last = 1ull << (m - 1);
+    size_t score = m;
+    for (unsigned char c : text)
+    {
+      uint64_t eq = peq[c];
+      uint64_t xv = eq | mv;
+      uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+      uint64_t ph = mv | ~(xh | pv);
+      uint64_t mh = pv & xh;
+      if (ph & last)
+        ++score;
+      else if (mh & last)
+        --score;
+      ph = ph << 1 | 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+    }
+    return score;
+  }
+
+  size_t dp_distance(const string& text) const
+  {
+    vector<size_t> row(query.size() + 1);
+    for (size_t i = 0; i <= query.size(); ++i)
+      row[i] = i;
+    for (size_t j = 1; j <= text.size(); ++j)
+    {
+      size_t diagonal = row[0];
+      row[0] = j;
+      for (size_t i = 1; i <= query.size(); ++i)
+      {
+        size_t above = row[i];
+        row[i] = min({row[i] + 1, row[i - 1] + 1,
+                      diagonal + (query[i - 1] != text[j - 1])});
+        diagonal = above;
+      }
+    }
+    return row[query.size()];
+  }
+
+  bool is_satisfied(Product* item) const override {
+    size_t n = item->name.size(), m = query.size();
+    if ((n > m ? n - m : m - n) > max_distance)
+      return false;
+    return distance(item->name) <= max_distance;
+  }
+};
+
+/*
+ Index for fuzzy name lookups over many products (a q-gram index). Each
+ distinct name is listed under every trigram (3 adjacent characters) and
+ every bigram it contains. One edit destroys at most q of the query's
+ q-grams, so a name within k edits shares at least (query q-grams - q*k)
+ of them; only names reaching that count in the posting lists, and with a
+ length within k of the query, are verified with NameFuzzySpecification's
+ distance. Trigram lists are short, so they are used whenever the bound
+ still excludes something, then bigrams; queries too short for either
+ fall back to checking every distinct name. Trigrams are hashed into 2^18
+ lists, which can only add candidates, never lose one.
+
+ NameFuzzySpecification stays the way to use fuzzy matching inside
+ composed specifications. Like CrackedIndex, the index keeps its own
+ pointers; the products must outlive it.
+*/
+class FuzzyNameIndex
+{
+  struct Name
+  {
+    const string* text;
+    vector<Product*> products;  // all products with this name
+  };
+
+  vector<Name> names;
+  vector<vector<uint32_t>> postings[2];  // bigram and trigram lists of names
+
+  // distinct q-gram ids of text, for q = 2 or 3
+  static vector<uint32_t> grams(const string& text, size_t q)
+  {
+    vector<uint32_t> ids;
+    for (size_t i = 0; i + q <= text.size(); ++i)
+    {
+      uint32_t id = 0;
+      for (size_t j = 0; j < q; ++j)
+        id = id << 8 | static_cast<unsigned char>(text[i + j]);
+      ids.push_back(q == 2 ? id : id * 2654435761u >> 14);
+    }
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+  }
+
+public:
+  explicit FuzzyNameIndex(const vector<Product*>& items)
+  {
+    postings[0].resize(1 << 16);
+    postings[1].resize(1 << 18);
+    unordered_map<string_view, uint32_t> ids;
+    for (auto* p : items)
+    {
+      auto [it, added] = ids.emplace(p->name, static_cast<uint32_t>(names.size()));
+      if (added)
+      {
+        names.push_back({&p->name, {}});
+        for (size_t q = 2; q <= 3; ++q)
+          for (uint32_t gram : grams(p->name, q))
+            postings[q - 2][gram].push_back(it->second);
+      }
+      names[it->second].products.push_back(p);
+    }
+  }
+
+  // products whose name is within max_distance edits of name
+  vector<Product*> find(const string& name, size_t max_distance) const
+  {
+    vector<Product*> result;
+    NameFuzzySpecification probe{name, max_distance};
+    auto check = [&](const Name& candidate) {
+      size_t n = candidate.text->size(), m = name.size();
+      if ((n > m ? n - m : m - n) <= max_distance
+          && probe.distance(*candidate.text) <= max_distance)
+        result.insert(result.end(), candidate.products.begin(), candidate.products.end());
+    };
+
+    for (size_t q = 3; q >= 2; --q)
+    {
+      auto query = grams(name, q);
+      if (query.size() <= q * max_distance)
+        continue;
+      size_t needed = query.size() - q * max_distance;
+
+      // shared q-gram counts, reset after every lookup on this thread
+      thread_local vector<uint16_t> counts;
+      thread_local vector<uint32_t> touched;
+      if (counts.size() < names.size())
+        counts.resize(names.size());
+      for (uint32_t gram : query)
+        for (uint32_t id : postings[q - 2][gram])
+        {
+          if (counts[id] == 0)
+            touched.push_back(id);
+          if (counts[id] < UINT16_MAX)
+            ++counts[id];
+        }
+      for (uint32_t id : touched)
+      {
+        if (counts[id] >= needed)
+          check(names[id]);
+        counts[id] = 0;
+      }
+      touched.clear();
+      return result;
+    }
+
+    for (auto& candidate : names)
+      check(candidate);
+    return result;
+  }
+};
+
+/*
+ Adaptive index over one product column (database cracking). No index is
+ built up front: every query partitions only the piece of the array that
+ can contain its value and remembers the boundary. The first query costs
+ about a scan; later ones touch smaller and smaller pieces. The index
+ keeps its own copy of the pointers, so results come back in cracked order.
+*/
+template <typename Key> class CrackedIndex
+{
+  vector<Product*> items;
+  Key Product::* column;
+  map<int64_t, size_t> cracks;  // value -> first position whose key is >= value
+
+  size_t crack(int64_t value)
+  {
+    auto found = cracks.find(value);
+    if (found != cracks.end())
+      return found->second;
+
+    auto next = cracks.upper_bound(value);
+    size_t hi = next == cracks.end() ? items.size() : next->second;
+    size_t lo = next == cracks.begin() ? 0 : prev(next)->second;
+    auto middle = partition(items.begin() + lo, items.begin() + hi,
+      [&](Product* p) { return static_cast<int64_t>(p->*column) < value; });
+    return cracks[value] = middle - items.begin();
+  }
+
+public:
+  CrackedIndex(vector<Product*> items, Key Product::* column)
+    : items{move(items)}, column{column} {}
+
+  // products whose key lies in [first, last]; keys are compared as int64_t
+  vector<Product*> range(Key first, Key last)
+  {
+    if (first > last)
+      return {};
+    int64_t upper = static_cast<int64_t>(last);
+    size_t begin = crack(static_cast<int64_t>(first));
+    size_t end = upper == numeric_limits<int64_t>::max() ? items.size()
+                                                         : crack(upper + 1);
+    return {items.begin() + begin, items.begin() + end};
+  }
+
+  vector<Product*> equal(Key key) { return range(key, key); }
+};
+
+/*
+ One pool of worker threads shared by everything in this file, started on
+ first use with one thread per core but one (the calling thread makes up
+ the last), so parallel paths never add threads of their own.
+*/
+class WorkerPool
+{
+  mutex m;
+  condition_variable wake;
+  deque<function<void()>> tasks;
+  vector<thread> workers;
+  bool stopping = false;
+#ifdef __linux__
+  vector<pid_t> tids;  // kernel ids of the workers, for per-thread counters
+  condition_variable started;
+#endif
+
+  WorkerPool()
+  {
+    unsigned count = max(2u, thread::hardware_concurrency()) - 1;
+    for (unsigned i = 0; i < count; ++i)
+      workers.emplace_back([this] {
+#ifdef __linux__
+        {
+          lock_guard<mutex> lock{m};
+          tids.push_back(static_cast<pid_t>(syscall(SYS_gettid)));
+        }
+        started.notify_one();
+#endif
+        for (;;)
+        {
+          function<void()> task;
+          {
+            unique_lock<mutex> lock{m};
+            wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+              return;
+            task = move(tasks.front());
+            tasks.pop_front();
+          }
+          task();
+        }
+      });
+#ifdef __linux__
+    unique_lock<mutex> lock{m};
+    started.wait(lock, [&] { return tids.size() == count; });
+#endif
+  }
+
+public:
+  static WorkerPool& instance()
+  {
+    static WorkerPool pool;
+    return pool;
+  }
+
+  ~WorkerPool()
+  {
+    {
+      lock_guard<mutex> lock{m};
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers)
+      w.join();
+  }
+
+  size_t size() const { return workers.size(); }
+
+#ifdef __linux__
+  const vector<pid_t>& thread_ids() const { return tids; }
+#endif
+
+  void submit(function<void()> task)
+  {
+    {
+      lock_guard<mutex> lock{m};
+      tasks.push_back(move(task));
+    }
+    wake.notify_one();
+  }
+};
+
+/*
+ Runs body(begin, end) over [0, count) on the shared pool. The caller and
+ the pool workers claim chunks from a shared counter, so a thread that
+ finishes early just takes more work instead of waiting on a fixed split.
+ The caller only waits for chunks that have been claimed, which keeps
+ nested calls from deadlocking: a helper that starts late finds nothing
+ left and returns. The first exception thrown by body is rethrown here.
+*/
+template <typename Body>
+void parallel_for(size_t count, size_t chunk, Body body)
+{
+  chunk = max<size_t>(chunk, 1);
+  size_t chunks = (count + chunk - 1) / chunk;
+  if (chunks <= 1)
+  {
+    if (count > 0)
+      body(0, count);
+    return;
+  }
+
+  struct State
+  {
+    atomic<size_t> next{0};
+    size_t done = 0;
+    exception_ptr error;
+    mutex m;
+    condition_variable finished;
+  };
+  auto state = make_shared<State>();
+
+  // helpers may outlive this call, but they only touch body while
+  // unfinished chunks remain, and those keep the caller waiting
+  auto run_chunks = [state, count, chunk, chunks, &body] {
+    for (size_t c; (c = state->next++) < chunks;)
+    {
+      exception_ptr error;
+      try
+      {
+        size_t begin = c * chunk;
+        body(begin, min(begin + chunk, count));
+      }
+      catch (...)
+      {
+        error = current_exception();
+      }
+      lock_guard<mutex> lock{state->m};
+      if (error && !state->error)
+        state->error = error;
+      if (++state->done == chunks)
+        state->finished.notify_all();
+    }
+  };
+
+  auto& pool = WorkerPool::instance();
+  for (size_t i = 0; i < min(pool.size(), chunks - 1); ++i)
+    pool.submit(run_chunks);
+  run_chunks();
+
+  exception_ptr error;
+  {
+    unique_lock<mutex> lock{state->m};
+    state->finished.wait(lock, [&] { return state->done == chunks; });
+    error = move(state->error);
+  }
+  if (error)
+    rethrow_exception(error);
+}
+
+/*
+ Another concrete filter with its own algorithm, as described at the top:
+ the specifications and the callers stay untouched. Each chunk is filtered
+ into its own vector and the pieces are joined in input order.
+*/
+struct ParallelFilter : Filter<Product>
+{
+  size_t chunk_size;
+
+  explicit ParallelFilter(size_t chunk_size = 4096)
+    : chunk_size{max<size_t>(chunk_size, 1)} {}
+
+  vector<Product*> filter(vector<Product*> items,
+                          Specification<Product> &spec) override
+  {
+    vector<vector<Product*>> parts((items.size() + chunk_size - 1) / chunk_size);
+    parallel_for(items.size(), chunk_size, [&](size_t begin, size_t end) {
+      auto& part = parts[begin / chunk_size];
+      for (size_t i = begin; i < end; ++i)
+        if (spec.is_satisfied(items[i]))
+          part.push_back(items[i]);
+    });
+
+    vector<Product*> result;
+    for (auto& part : parts)
+      result.insert(result.end(), part.begin(), part.end());
+    return result;
+  }
+};
+
+/*
+ Filtering that can be abandoned. The work runs on the shared worker pool
+ and checks the cancellation token and the deadline between chunks; when
+ either fires it stops and returns what it has so far, marked truncated.
+
+ The queued task co-owns the specification and the token, so a client may
+ cancel and drop the future straight away. Anything the specification
+ refers to (the parts of an AndSpecification) and the products must still
+ stay alive until the task finishes, which is within one chunk of the
+ cancel.
+*/
+struct CancellationToken
+{
+  atomic<bool> cancelled{false};
+
+  void cancel() { cancelled = true; }
+};
+
+struct FilterResult
+{
+  vector<Product*> items;
+  bool truncated = false;
+};
+
+struct AsyncFilter
+{
+  size_t chunk_size;
+
+  explicit AsyncFilter(size_t chunk_size = 4096)
+    : chunk_size{max<size_t>(chunk_size, 1)} {}
+
+  future<FilterResult> filter(vector<Product*> items,
+                              shared_ptr<const Specification<Product>> spec,
+                              chrono::steady_clock::time_point deadline,
+                              shared_ptr<const CancellationToken> token)
+  {
+    auto task = make_shared<packaged_task<FilterResult()>>(
+      [chunk_size = chunk_size, items = move(items), spec = move(spec), deadline,
+       token = move(token)] {
+        FilterResult result;
+        for (size_t begin = 0; begin < items.size(); begin += chunk_size)
+        {
+          if (token->cancelled || chrono::steady_clock::now() > deadline)
+          {
+            result.truncated = true;
+            break;
+          }
+          size_t end = min(begin + chunk_size, items.size());
+          for (size_t i = begin; i < end; ++i)
+            if (spec->is_satisfied(items[i]))
+              result.items.push_back(items[i]);
+        }
+        return result;
+      });
+    auto result = task->get_future();
+    WorkerPool::instance().submit([task] { (*task)(); });
+    return result;
+  }
+};
+
+/*
+ Number of distinct values of one product field among the items that
+ satisfy a specification, computed in the same pass that evaluates it.
+ The exact mode keeps pointers to the values in a hash set, so nothing is
+ copied. The approximate mode is a HyperLogLog sketch (2^14 one-byte
+ registers, about 1% error). Chunks are sketched in parallel and their
+ registers merged with a bytewise max. That loop takes restrict pointers
+ and a fixed count, so there is no alias check or unknown trip count in
+ the way and GCC turns it into pmaxub (16 registers per instruction)
+ already at -O2.
+*/
+enum class DistinctMode { exact, approximate };
+
+class HyperLogLog
+{
+  static const int precision = 14;
+  static const size_t register_count = size_t{1} << precision;
+  vector<uint8_t> registers;
+
+  static void max_into(uint8_t* __restrict dst, const uint8_t* __restrict src)
+  {
+    for (size_t i = 0; i < register_count; ++i)
+      dst[i] = max(dst[i], src[i]);
+  }
+
+public:
+  HyperLogLog() : registers(register_count, 0) {}
+
+  void add(uint64_t h)
+  {
+    // finalizer from splitmix64, so weak std::hash values still spread out
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27; h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+
+    size_t index = h >> (64 - precision);
+    uint64_t rest = h << precision | uint64_t{1} << (precision - 1);
+    uint8_t rank = 1;
+    while (!(rest & uint64_t{1} << 63))
+    {
+      rest <<= 1;
+      ++rank;
+    }
+    registers[index] = max(registers[index], rank);
+  }
+
+  void merge(const HyperLogLog& other)
+  {
+    if (&other != this)
+      max_into(registers.data(), other.registers.data());
+  }
+
+  double estimate() const
+  {
+    double m = static_cast<double>(registers.size());
+    double sum = 0;
+    size_t zeros = 0;
+    for (uint8_t r : registers)
+    {
+      sum += ldexp(1.0, -r);
+      zeros += r == 0;
+    }
+    double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0)
+      e = m * log(m / zeros);  // linear counting for small cardinalities
+    return e;
+  }
+};
+
+template <typename Field>
+size_t count_distinct(const vector<Product*>& items,
+                      const Specification<Product>& spec,
+                      Field Product::* field,
+                      DistinctMode mode = DistinctMode::exact)
+{
+  if (mode == DistinctMode::exact)
+  {
+    auto hash_value = [](const Field* f) { return hash<Field>{}(*f); };
+    auto same_value = [](const Field* a, const Field* b) { return *a == *b; };
+    unordered_set<const Field*, decltype(hash_value), decltype(same_value)>
+      seen(16, hash_value, same_value);
+    for (auto* p : items)
+      if (spec.is_satisfied(p))
+        seen.insert(&(p->*field));
+    return seen.size();
+  }
+
+  const size_t chunk = 1 << 16;
+  vector<HyperLogLog> sketches((items.size() + chunk - 1) / chunk);
+  parallel_for(items.size(), chunk, [&](size_t begin, size_t end) {
+    auto& sketch = sketches[begin / chunk];
+    for (size_t i = begin; i < end; ++i)
+      if (spec.is_satisfied(items[i]))
+        sketch.add(hash<Field>{}(items[i]->*field));
+  });
+
+  HyperLogLog total;
+  for (auto& sketch : sketches)
+    total.merge(sketch);
+  return static_cast<size_t>(llround(total.estimate()));
+}
+
+/*
+ Minimal tracing. A ScopedSpan records its name and duration into a ring
+ buffer owned by the current thread, so recording takes no locks; names
+ must be string literals and are stored as pointers. When a thread exits
+ its buffer goes back to the tracer and is reused by the next new thread,
+ so memory is bounded by the number of threads alive at once times
+ capacity events (set_capacity, before tracing starts). A reused buffer
+ starts empty under a new tid, so the exited thread's events are dropped
+ at that point; export before recycling threads if they matter.
+
+ The tracer is never destroyed: threads of the worker pool exit during
+ static destruction and still hand their buffers back.
+
+ write_chrome_trace dumps all buffers as Chrome trace JSON (chrome://tracing
+ or Perfetto). Each ring publishes its event count with release ordering,
+ so every event the export sees is complete. The one exception is a ring
+ that wraps during the export: its oldest slots may be overwritten while
+ they are read. Export after the traced work has finished to avoid that.
+ Building with DISABLE_TRACING turns ScopedSpan into an empty object.
+*/
+struct TraceEvent
+{
+  const char* name;
+  int64_t start_ns, duration_ns;
+};
+
+class Tracer
+{
+  struct Buffer
+  {
+    unsigned tid;
+    vector<TraceEvent> ring;
+    atomic<size_t> written{0};
+  };
+
+  // hands the thread's buffer back when the thread exits
+  struct Lease
+  {
+    Buffer* buffer = nullptr;
+    ~Lease()
+    {
+      if (buffer)
+        Tracer::instance().release(buffer);
+    }
+  };
+
+  mutex registry;
+  vector<unique_ptr<Buffer>> buffers;
+  vector<Buffer*> released;
+  size_t capacity = 4096;
+  unsigned next_tid = 1;
+
+  Tracer() = default;
+
+  Buffer* acquire()
+  {
+    lock_guard<mutex> lock{registry};
+    Buffer* b;
+    if (!released.empty())
+    {
+      b = released.back();
+      released.pop_back();
+      b->written.store(0, memory_order_relaxed);
+    }
+    else
+    {
+      buffers.push_back(make_unique<Buffer>());
+      b = buffers.back().get();
+      b->ring.resize(capacity);
+    }
+    b->tid = next_tid++;
+    return b;
+  }
+
+  void release(Buffer* b)
+  {
+    lock_guard<mutex> lock{registry};
+    released.push_back(b);
+  }
+
+public:
+  static Tracer& instance()
+  {
+    static Tracer* tracer = new Tracer;
+    return *tracer;
+  }
+
+  static int64_t now_ns()
+  {
+    return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // events kept per thread; applies to buffers created afterwards
+  void set_capacity(size_t events)
+  {
+    lock_guard<mutex> lock{registry};
+    capacity = max<size_t>(events, 1);
+  }
+
+  void record(const char* name, int64_t start_ns, int64_t end_ns)
+  {
+    thread_local Lease lease;
+    if (!lease.buffer)
+      lease.buffer = acquire();
+    Buffer& b = *lease.buffer;
+    size_t i = b.written.load(memory_order_relaxed);
+    b.ring[i % b.ring.size()] = {name, start_ns, end_ns - start_ns};
+    b.written.store(i + 1, memory_order_release);
+  }
+
+  void write_chrome_trace(ostream& os)
+  {
+    lock_guard<mutex> lock{registry};
+    auto flags = os.flags();
+    auto precision = os.precision(3);
+    os << fixed << "{\"traceEvents\":[";
+    const char* separator = "";
+    for (auto& b : buffers)
+    {
+      size_t written = b->written.load(memory_order_acquire);
+      size_t size = b->ring.size();
+      for (size_t i = written > size ? written - size : 0; i < written; ++i)
+      {
+        auto& e = b->ring[i % size];
+        os << separator << "{\"name\":\"" << e.name
+           << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+           << ",\"ts\":" << e.start_ns / 1000.0
+           << ",\"dur\":" << e.duration_ns / 1000.0 << "}";
+        separator = ",";
+      }
+    }
+    os << "]}\n";
+    os.flags(flags);
+    os.precision(precision);
+  }
+};
+
+#ifndef DISABLE_TRACING
+struct ScopedSpan
+{
+  const char* name;
+  int64_t start_ns;
+
+  explicit ScopedSpan(const char* name)
+    : name{name}, start_ns{Tracer::now_ns()} {}
+  ~ScopedSpan() { Tracer::instance().record(name, start_ns, Tracer::now_ns()); }
+};
+#else
+struct ScopedSpan
+{
+  explicit ScopedSpan(const char*) {}
+};
+#endif
+
+/*
+ Decorator that traces any filter without modifying it.
+*/
+struct TracingFilter : Filter<Product>
+{
+  Filter<Product>& inner;
+
+  explicit TracingFilter(Filter<Product>& inner) : inner{inner} {}
+
+  vector<Product*> filter(vector<Product*> items,
+                          Specification<Product> &spec) override
+  {
+    ScopedSpan span{"filter"};
+    return inner.filter(move(items), spec);
+  }
+};
+
+/*
+ Hardware performance counters around a region of code, through Linux
+ perf_event_open. Counters that cannot be opened (another OS, or a
+ container without perf access) are marked unavailable rather than
+ failing, so the measured code runs the same either way.
+
+ Counted are the calling thread, threads it starts inside the scope
+ (inherit), and the workers of the shared pool, which already exist and
+ so get counters of their own. Pool workers are counted for the whole
+ scope, including work they do for other callers at the same time.
+
+ The counters are opened independently (inherit rules out a group read),
+ so with more events than hardware counters the kernel multiplexes them.
+ Each value is therefore scaled by time enabled over time running, an
+ estimate of the full-run count; an event that cannot be opened on the
+ calling thread, or never runs there, is unavailable.
+*/
+struct PerfCounters
+{
+  enum Counter { cycles, instructions, cache_misses, branch_misses, dtlb_misses, count };
+  static constexpr const char* names[count] = {
+    "cycles", "instructions", "cache-misses", "branch-misses", "dTLB-misses"};
+
+  int64_t value[count] = {};
+  bool available[count] = {};
+};
+
+class PerfScope
+{
+  PerfCounters& result;
+  // one row of counters per thread: the caller first, then the pool workers
+  vector<array<int, PerfCounters::count>> fds;
+
+public:
+  explicit PerfScope(PerfCounters& result) : result{result}
+  {
+#ifdef __linux__
+    const pair<uint32_t, uint64_t> events[PerfCounters::count] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                           | PERF_COUNT_HW_CACHE_OP_READ << 8
+                           | PERF_COUNT_HW_CACHE_RESULT_MISS << 16}};
+    vector<pid_t> threads{0};  // 0 is the calling thread
+    auto& workers = WorkerPool::instance().thread_ids();
+    threads.insert(threads.end(), workers.begin(), workers.end());
+
+    fds.resize(threads.size());
+    for (size_t t = 0; t < threads.size(); ++t)
+      for (int i = 0; i < PerfCounters::count; ++i)
+      {
+        perf_event_attr attr{};
+        attr.size = sizeof attr;
+        attr.type = events[i].first;
+        attr.config = events[i].second;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = t == 0;  // include threads started inside the scope
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[t][i] = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, threads[t], -1, -1, 0));
+      }
+    for (auto& row : fds)
+      for (int fd : row)
+        if (fd >= 0)
+        {
+          ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+          ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+  }
+
+  PerfScope(const PerfScope&) = delete;
+  PerfScope& operator=(const PerfScope&) = delete;
+
+  ~PerfScope()
+  {
+#ifdef __linux__
+    for (auto& row : fds)
+      for (int fd : row)
+        if (fd >= 0)
+          ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    for (int i = 0; i < PerfCounters::count; ++i)
+    {
+      double total = 0;
+      for (size_t t = 0; t < fds.size(); ++t)
+      {
+        if (fds[t][i] < 0)
+          continue;
+        uint64_t data[3] = {};  // value, time enabled, time running
+        bool ok = read(fds[t][i], data, sizeof data) == sizeof data && data[2] > 0;
+        if (t == 0)
+          result.available[i] = ok;
+        if (ok)
+          total += static_cast<double>(data[0]) * data[1] / data[2];
+        close(fds[t][i]);
+      }
+      result.value[i] = result.available[i] ? static_cast<int64_t>(total) : 0;
+    }
+#endif
+  }
+};
+
 int main()
 {
   Product apple{"Apple", Color::green, Size::small};
@@ -197,6 +1148,52 @@ int main()
   for (auto& x : bf.filter(all, spec2))
     cout << x->name << " is green and large\n";
 
+  InSetSpecification<Product> allowed({"Tree", "House"});
+  auto allowed_and_green = allowed && green;
+  for (auto& x : bf.filter(all, allowed_and_green))
+    cout << x->name << " is allowed and green\n";
+
+  NameFuzzySpecification like_house{"Huose", 2};
+  for (auto& x : bf.filter(all, like_house))
+    cout << x->name << " is spelled like Huose\n";
+
+  FuzzyNameIndex names{all};
+  for (auto& x : names.find("Huose", 2))
+    cout << x->name << " is spelled like Huose (indexed)\n";
+
+  CrackedIndex<Size> by_size{all, &Product::size};
+  for (auto& x : by_size.equal(large.size))
+    cout << x->name << " is large (cracked)\n";
+
+  ParallelFilter pf;
+  for (auto& x : pf.filter(all, spec))
+    cout << x->name << " is green and large (parallel)\n";
+
+  AsyncFilter af;
+  auto token = make_shared<CancellationToken>();
+  auto pending = af.filter(all, make_shared<AndSpecification<Product>>(green, large),
+    chrono::steady_clock::now() + chrono::milliseconds{100}, token);
+  auto result = pending.get();
+  for (auto& x : result.items)
+    cout << x->name << " is green and large (async"
+         << (result.truncated ? ", truncated" : "") << ")\n";
+
+  cout << count_distinct(all, green, &Product::name)
+       << " distinct names are green\n";
+
+  TracingFilter traced{pf};
+  PerfCounters counters;
+  {
+    PerfScope measure{counters};
+    traced.filter(all, spec);
+  }
+  for (int i = 0; i < PerfCounters::count; ++i)
+    if (counters.available[i])
+      cout << PerfCounters::names[i] << ": " << counters.value[i] << "\n";
+    else
+      cout << PerfCounters::names[i] << ": unavailable\n";
+  Tracer::instance().write_chrome_trace(cout);
+
   getchar();
   return 0;
 }
\ No newline at end of file
@@ -12,17 +12,33 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <vector>
+#include <memory_resource>
+#include <stdexcept>
+#include <thread>
+#include <future>
+#include <functional>
+#include <iterator>
+#include <cstdint>
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define JOURNAL_SEARCH_SSE2 1
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 struct Journal
 {
   string title;
-  vector<string> entries;
+  pmr::vector<pmr::string> entries;
 
-  explicit Journal(const string& title)
-    : title{title}
+  // entries are allocated from resource, e.g. a request-scoped
+  // monotonic_buffer_resource that is released all at once
+  explicit Journal(const string& title,
+                   pmr::memory_resource* resource = pmr::get_default_resource())
+    : title{title}, entries{resource}
   {
   }
 
@@ -37,7 +53,7 @@ struct Journal
 void Journal::add(const string& entry)
 {
   static int count = 1;
-  entries.push_back(std::to_string(count++)
+  entries.emplace_back(std::to_string(count++)
     + ": " + entry);
 }
 
@@ -72,9 +88,193 @@ struct PersistenceManager
   }
 };
 
+/*
+JournalSearch has the single responsibility of searching saved journals.
+There is no index to maintain: the file is read in large blocks, and only
+complete entries (lines) are scanned; the unfinished entry at the end of a
+block is carried into the next one, so a match can never be split.
+
+Each block is cut at line boundaries into one piece per core, and the
+pieces are scanned on their own threads. A piece is scanned once for all
+patterns together: every position whose first two bytes begin some pattern
+is a candidate, and candidates are verified with memcmp. With SSE2 the
+candidates are found 16 positions at a time, one compare pair per pattern;
+elsewhere a bit table of the leading byte pairs is checked per position.
+Each entry that contains any of the patterns is reported once, in file
+order. A file that cannot be opened or read throws.
+*/
+struct JournalSearch
+{
+  static const size_t block_size = 1 << 24;
+  static const size_t min_piece_size = 1 << 20;
+
+  static vector<string> find(const string& filename, const string& pattern)
+  {
+    return find_any(filename, {pattern});
+  }
+
+  static vector<string> find_any(const string& filename, const vector<string>& patterns)
+  {
+    vector<string> result;
+    ifstream ifs(filename, ios::binary);
+    if (!ifs)
+      throw runtime_error("cannot open " + filename);
+    // the unfinished entry of the previous block is kept at the front of
+    // the buffer, and the buffer grows if a single entry does not fit
+    vector<char> buffer(block_size);
+    size_t carried = 0;
+    while (ifs)
+    {
+      ifs.read(buffer.data() + carried, buffer.size() - carried);
+      if (ifs.bad())
+        throw runtime_error("cannot read " + filename);
+      size_t filled = carried + static_cast<size_t>(ifs.gcount());
+
+      size_t complete = filled;
+      if (ifs)
+      {
+        auto newline = std::find(make_reverse_iterator(buffer.begin() + filled),
+                                 buffer.rend(), '\n');
+        if (newline == buffer.rend())
+        {
+          carried = filled;
+          buffer.resize(buffer.size() * 2);
+          continue;
+        }
+        complete = newline.base() - buffer.begin();
+      }
+      scan_parallel(buffer.data(), complete, patterns, result);
+      carried = filled - complete;
+      memmove(buffer.data(), buffer.data() + complete, carried);
+    }
+    return result;
+  }
+
+private:
+  static void scan_parallel(const char* begin, size_t size,
+                            const vector<string>& patterns, vector<string>& result)
+  {
+    const char* end = begin + size;
+    size_t threads = min<size_t>(max(1u, thread::hardware_concurrency()),
+                                 size / min_piece_size + 1);
+    vector<const char*> cuts{begin};
+    for (size_t i = 1; i < threads; ++i)
+    {
+      const char* at = max(begin + size / threads * i, cuts.back());
+      auto newline = static_cast<const char*>(memchr(at, '\n', end - at));
+      if (!newline || newline + 1 == end)
+        break;
+      cuts.push_back(newline + 1);
+    }
+    cuts.push_back(end);
+
+    auto pairs = leading_pairs(patterns);
+    vector<vector<string>> parts(cuts.size() - 1);
+    vector<future<void>> pending;
+    for (size_t i = 1; i < parts.size(); ++i)
+      pending.push_back(async(launch::async, scan, cuts[i], cuts[i + 1],
+                              cref(patterns), cref(pairs), ref(parts[i])));
+    scan(cuts[0], cuts[1], patterns, pairs, parts[0]);
+    for (auto& piece : pending)
+      piece.get();
+
+    for (auto& part : parts)
+      result.insert(result.end(), make_move_iterator(part.begin()),
+                    make_move_iterator(part.end()));
+  }
+
+  // one bit for every pair of bytes that some pattern starts with
+  static vector<uint64_t> leading_pairs(const vector<string>& patterns)
+  {
+    vector<uint64_t> pairs(1 << 10);
+    auto mark = [&](unsigned pair) { pairs[pair >> 6] |= uint64_t{1} << (pair & 63); };
+    for (auto& pattern : patterns)
+    {
+      if (pattern.empty())
+        continue;
+      unsigned first = static_cast<unsigned char>(pattern[0]) << 8;
+      if (pattern.size() == 1)
+        for (unsigned second = 0; second < 256; ++second)
+          mark(first | second);
+      else
+        mark(first | static_cast<unsigned char>(pattern[1]));
+    }
+    return pairs;
+  }
+
+  static void scan(const char* begin, const char* end,
+                   const vector<string>& patterns, const vector<uint64_t>& pairs,
+                   vector<string>& result)
+  {
+    auto match_at = [&](const char* p) {
+      for (auto& pattern : patterns)
+        if (!pattern.empty() && static_cast<size_t>(end - p) >= pattern.size()
+            && memcmp(p, pattern.data(), pattern.size()) == 0)
+          return true;
+      return false;
+    };
+
+    // reports the entry holding p once; scanning resumes after it
+    auto report = [&](const char* p) {
+      const char* first = p;
+      while (first > begin && first[-1] != '\n')
+        --first;
+      const char* last = static_cast<const char*>(memchr(p, '\n', end - p));
+      if (!last)
+        last = end;
+      result.emplace_back(first, last);
+      return last + (last < end);
+    };
+
+    const char* p = begin;
+#ifdef JOURNAL_SEARCH_SSE2
+    // 16 positions at a time: compare the bytes at p and p + 1 with the
+    // first two bytes of every pattern (any second byte for one-byte ones)
+    struct Lead { __m128i first, second, any; };
+    vector<Lead> leads;
+    for (auto& pattern : patterns)
+      if (!pattern.empty())
+        leads.push_back({_mm_set1_epi8(pattern[0]),
+                         _mm_set1_epi8(pattern.size() > 1 ? pattern[1] : 0),
+                         _mm_set1_epi8(pattern.size() > 1 ? 0 : -1)});
+    while (end - p > 16)
+    {
+      __m128i here = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+      __m128i hit = _mm_setzero_si128();
+      for (auto& lead : leads)
+        hit = _mm_or_si128(hit, _mm_and_si128(
+          _mm_cmpeq_epi8(here, lead.first),
+          _mm_or_si128(_mm_cmpeq_epi8(next, lead.second), lead.any)));
+
+      const char* resume = p + 16;
+      for (unsigned mask = _mm_movemask_epi8(hit); mask; mask &= mask - 1)
+        if (match_at(p + __builtin_ctz(mask)))
+        {
+          resume = report(p + __builtin_ctz(mask));
+          break;
+        }
+      p = resume;
+    }
+#endif
+
+    while (p < end)
+    {
+      // the last byte has no successor; only a one-byte pattern can start there
+      unsigned pair = static_cast<unsigned char>(p[0]) << 8
+                      | (p + 1 < end ? static_cast<unsigned char>(p[1]) : 0);
+      if ((pairs[pair >> 6] >> (pair & 63) & 1) && match_at(p))
+        p = report(p);
+      else
+        ++p;
+    }
+  }
+};
+
 int main()
 {
-  Journal journal{"Dear Diary"};
+  pmr::monotonic_buffer_resource arena;
+  Journal journal{"Dear Diary", &arena};
   journal.add("I ate a bug");
   journal.add("I cried today");
 
@@ -83,5 +283,8 @@ int main()
   PersistenceManager pm;
   pm.save(journal, "diary.txt");
 
+  for (auto& entry : JournalSearch::find_any("diary.txt", {"cried", "bug"}))
+    cout << "found: " << entry << endl;
+
   return 0;
 }
\ No newline at end of file